@@ -7,8 +7,15 @@ type ClientStats = {
     Address : IPEndPoint
     IncomingBandwidth : uint
     OutgoingBandwidth : uint
+    /// Fraction of 65536
     PacketLoss : uint
+    /// Milliseconds
     RoundTripTime : uint
+    RoundTripTimeVariance : uint
+    /// Fraction of 32 of unreliable packets that are sent
+    PacketThrottle : uint
+    /// Reliable bytes sent but not yet acknowledged
+    ReliableDataInTransit : uint
 }
 
 type IClient =
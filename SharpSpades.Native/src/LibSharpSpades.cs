@@ -26,6 +26,9 @@ public static partial class LibSharpSpades
     [LibraryImport(LibraryName, EntryPoint = nameof(map_create))]
     public static partial IntPtr map_create();
 
+    [LibraryImport(LibraryName, EntryPoint = nameof(map_create_with_storage))]
+    public static partial IntPtr map_create_with_storage(MapStorage storage);
+
     [LibraryImport(LibraryName, EntryPoint = nameof(map_destroy))]
     public static partial void map_destroy(IntPtr map);
 
@@ -35,11 +38,20 @@ public static partial class LibSharpSpades
     [LibraryImport(LibraryName)]
     public static unsafe partial int map_writer_init(MapWriter* w);
 
+    [LibraryImport(LibraryName)]
+    public static unsafe partial void map_writer_init_buffer(MapWriter* w, byte* buffer, int capacity);
+
     [LibraryImport(LibraryName)]
     public static unsafe partial void map_writer_deinit(MapWriter* w);
 
     [LibraryImport(LibraryName)]
-    public static unsafe partial void map_write(IntPtr map, MapWriter* w);
+    public static unsafe partial int map_write(IntPtr map, MapWriter* w);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(compress_parallel))]
+    public static unsafe partial int compress_parallel(byte* data, nuint len, int level, int threads, byte** output, nuint* outputLen);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(compress_free))]
+    public static unsafe partial void compress_free(byte* data);
 
     [LibraryImport(LibraryName, EntryPoint = nameof(map_set))]
     public static partial void map_set(IntPtr map, ushort x, ushort y, ushort z, Block b);
@@ -53,6 +65,9 @@ public static partial class LibSharpSpades
     [LibraryImport(LibraryName, EntryPoint = nameof(map_is_surface))]
     public static partial int map_is_surface(IntPtr map, ushort x, ushort y, ushort z);
 
+    [LibraryImport(LibraryName, EntryPoint = nameof(map_boxes_clear))]
+    public static unsafe partial int map_boxes_clear(IntPtr map, Box* boxes, int n, byte* clear);
+
     [LibraryImport(LibraryName, EntryPoint = nameof(player_create))]
     public static unsafe partial Player* player_create();
 
@@ -68,6 +83,39 @@ public static partial class LibSharpSpades
     [LibraryImport(LibraryName, EntryPoint = nameof(move_player))]
     public static unsafe partial long move_player(IntPtr map, Player* player, float delta, float time);
 
+    [LibraryImport(LibraryName, EntryPoint = nameof(validate_placements))]
+    public static unsafe partial int validate_placements(IntPtr map, Player** players, int n, Player* placer,
+        Vec3i* cells, int count, PlacementError* mask);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(movement_verifier_create))]
+    public static partial IntPtr movement_verifier_create(int players);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(movement_verifier_destroy))]
+    public static partial void movement_verifier_destroy(IntPtr verifier);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(movement_verifier_reset))]
+    public static unsafe partial int movement_verifier_reset(IntPtr verifier, int player, Player* state);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(movement_verifier_remove))]
+    public static partial void movement_verifier_remove(IntPtr verifier, int player);
+
+    // Takes the InputState bits as they are in InputData
+    [LibraryImport(LibraryName, EntryPoint = nameof(movement_verifier_input))]
+    public static partial int movement_verifier_input(IntPtr verifier, int player, byte keys);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(movement_verifier_orientation))]
+    public static partial int movement_verifier_orientation(IntPtr verifier, int player, Vec3f orientation);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(movement_verifier_report))]
+    public static partial int movement_verifier_report(IntPtr verifier, int player, Vec3f position);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(movement_verifier_tick))]
+    public static unsafe partial int movement_verifier_tick(IntPtr verifier, IntPtr pool, IntPtr map, float delta,
+        float time, MovementPolicy* policy, MovementCorrection* corrections);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(movement_verifier_get))]
+    public static unsafe partial int movement_verifier_get(IntPtr verifier, int player, Player* state);
+
     [LibraryImport(LibraryName, EntryPoint = nameof(grenade_create))]
     public static partial IntPtr grenade_create(Vec3f position, Vec3f velocity);
 
@@ -76,4 +124,37 @@ public static partial class LibSharpSpades
 
     [LibraryImport(LibraryName, EntryPoint = nameof(move_grenade))]
     public static partial void move_grenade(IntPtr map, IntPtr grenade, float delta);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(resolve_shot))]
+    public static unsafe partial int resolve_shot(IntPtr map, Player* shooter, Vec3f orientation, float length,
+        Player** players, int n, ShotResult* result);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(resolve_explosion))]
+    public static partial int resolve_explosion(IntPtr map, Vec3f center, ReadOnlySpan<Vec3f> players, int n, Span<ExplosionHit> hits);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(resolve_explosions))]
+    public static partial int resolve_explosions(IntPtr pool, IntPtr map, ReadOnlySpan<Vec3f> centers, int count,
+        ReadOnlySpan<Vec3f> players, int n, Span<ExplosionHit> hits, Span<int> counts);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(worker_pool_create))]
+    public static partial IntPtr worker_pool_create(int threads);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(worker_pool_destroy))]
+    public static partial void worker_pool_destroy(IntPtr pool);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(can_see))]
+    public static partial long can_see(IntPtr map, float x0, float y0, float z0, float x1, float y1, float z1);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(can_see_matrix))]
+    public static partial int can_see_matrix(IntPtr pool, IntPtr map, ReadOnlySpan<Vec3f> positions, int n, float maxDistance, Span<byte> output);
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(world_update_builder_create))]
+    public static partial IntPtr world_update_builder_create();
+
+    [LibraryImport(LibraryName, EntryPoint = nameof(world_update_builder_destroy))]
+    public static partial void world_update_builder_destroy(IntPtr builder);
+
+    [LibraryImport(LibraryName)]
+    public static unsafe partial int world_update_build(IntPtr builder, IntPtr pool, IntPtr map,
+        WorldUpdatePlayers* players, WorldUpdatePolicy* policy, byte** buffers, int* index);
 }
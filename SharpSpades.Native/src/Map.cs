@@ -1,11 +1,49 @@
+using System.Buffers;
 using System.Runtime.InteropServices;
 
 namespace SharpSpades.Native;
 
+// Palette storage keeps a 16-bit index per voxel instead of the block,
+// about half the memory for real maps
+public enum MapStorage
+{
+    Full = 0,
+    Palette = 1
+}
+
 [StructLayout(LayoutKind.Sequential)]
 public struct MapWriter
 {
     public IntPtr Buffer { get; }
     public int BufferCapacity { get; }
     public int BufferLength { get; }
+    // The writer allocated Buffer, otherwise it is the caller's
+    public int Owned { get; }
+    public int Failed { get; }
+}
+
+// Lends native memory, such as a map writer's buffer, as Memory without
+// copying it. The memory must outlive every use of Memory.
+public sealed unsafe class NativeMemoryManager : MemoryManager<byte>
+{
+    private readonly byte* pointer;
+    private readonly int length;
+
+    public NativeMemoryManager(IntPtr pointer, int length)
+    {
+        this.pointer = (byte*)pointer;
+        this.length = length;
+    }
+
+    public override Span<byte> GetSpan() => new(pointer, length);
+
+    public override MemoryHandle Pin(int elementIndex = 0) => new(pointer + elementIndex);
+
+    public override void Unpin()
+    {
+    }
+
+    protected override void Dispose(bool disposing)
+    {
+    }
 }
@@ -15,7 +15,10 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+using System.Net;
+using System.Runtime.CompilerServices;
 using System.Runtime.InteropServices;
+using System.Text;
 using SharpSpades.Net;
 
 namespace SharpSpades.Native.Net;
@@ -42,6 +45,304 @@ public unsafe delegate CallbackResult ReceiveCallback(uint client, byte* buffer,
 [UnmanagedFunctionPointer(CallingConvention.Cdecl)]
 public delegate CallbackResult DisconnectCallback(uint client, DisconnectType type);
 
+[UnmanagedFunctionPointer(CallingConvention.Cdecl)]
+public delegate CallbackResult StreamCallback(uint client, NetEventType type, uint bytes);
+
+[StructLayout(LayoutKind.Sequential)]
+public unsafe struct PeerStats
+{
+    public const int AddressLength = 48;
+
+    public readonly uint Client;
+    public readonly AddressType AddressType;
+    public readonly uint Port;
+    // Milliseconds, smoothed by ENet
+    public readonly uint RoundTripTime;
+    public readonly uint RoundTripTimeVariance;
+    // Fraction of 65536
+    public readonly uint PacketLoss;
+    public readonly uint PacketLossVariance;
+    // Fraction of 32
+    public readonly uint PacketThrottle;
+    // Advertised by the client in bytes per second, zero for unlimited
+    public readonly uint IncomingBandwidth;
+    public readonly uint OutgoingBandwidth;
+    public readonly uint ReliableDataInTransit;
+    private fixed byte address[AddressLength];
+
+    public IPEndPoint EndPoint
+    {
+        get
+        {
+            fixed (byte *a = address)
+            {
+                var bytes = new ReadOnlySpan<byte>(a, AddressLength);
+                int len = bytes.IndexOf((byte)0);
+                if (len >= 0)
+                    bytes = bytes[..len];
+                if (!IPAddress.TryParse(Encoding.ASCII.GetString(bytes), out var ip))
+                    ip = IPAddress.None;
+                return new IPEndPoint(ip, (int)Port);
+            }
+        }
+    }
+}
+
+// Totals for one packet id since the host was created
+[StructLayout(LayoutKind.Sequential)]
+public readonly struct PacketCounters
+{
+    public readonly ulong PacketsIn;
+    public readonly ulong BytesIn;
+    public readonly ulong PacketsOut;
+    public readonly ulong BytesOut;
+    public readonly ulong Drops;
+    // Time spent in the receive callback
+    public readonly ulong CallbackNanoseconds;
+}
+
+[InlineArray(NetCounters.PacketIds)]
+public struct PacketCountersArray
+{
+    private PacketCounters element;
+}
+
+[InlineArray(NetCounters.HistogramBuckets)]
+public struct Histogram
+{
+    private ulong element;
+}
+
+// Bucket i of the histograms counts durations of at least 2^(i-1) and less
+// than 2^i microseconds.
+[StructLayout(LayoutKind.Sequential)]
+public struct NetCounters
+{
+    public const int PacketIds = 256;
+    public const int HistogramBuckets = 24;
+
+    public PacketCountersArray Packets;
+    // Duration of PollEvents calls
+    public Histogram PollMicroseconds;
+    // Time spent handling events each time ENet had some
+    public Histogram ServiceMicroseconds;
+}
+
+// One host in a NetRegistry, the counters are totals over every packet id
+[StructLayout(LayoutKind.Sequential)]
+public readonly struct HostSummary
+{
+    public readonly uint Id;
+    public readonly uint Port;
+    public readonly uint Clients;
+    public readonly uint MaxClients;
+    public readonly ulong PacketsIn;
+    public readonly ulong BytesIn;
+    public readonly ulong PacketsOut;
+    public readonly ulong BytesOut;
+    public readonly ulong Drops;
+}
+
+[StructLayout(LayoutKind.Sequential)]
+internal struct SendDescriptor
+{
+    public uint Client;
+    public int Flags;
+    public uint Offset;
+    public uint Length;
+}
+
+[StructLayout(LayoutKind.Sequential)]
+internal unsafe struct SendQueue
+{
+    public SendDescriptor* Descriptors;
+    public byte* Data;
+    public uint DescriptorsCapacity;
+    public uint DataCapacity;
+    public uint DescriptorsLength;
+    public uint DataLength;
+}
+
+public enum NetEventType : uint
+{
+    Connect = 0,
+    Disconnect = 1,
+    StreamProgress = 2,
+    StreamComplete = 3
+}
+
+[StructLayout(LayoutKind.Sequential)]
+public readonly unsafe struct ReceivedPacket
+{
+    public readonly uint Client;
+    public readonly uint Length;
+    private readonly byte* data;
+    private readonly IntPtr packet;
+
+    // Only valid until NetHost.ReleaseReceives is called
+    public ReadOnlySpan<byte> Data => new(data, (int)Length);
+}
+
+[StructLayout(LayoutKind.Sequential)]
+public readonly struct NetEvent
+{
+    public readonly NetEventType Type;
+    public readonly uint Client;
+    // The protocol version for connects, the disconnect type for disconnects,
+    // the acknowledged bytes for stream progress and the length for completions
+    public readonly uint Data;
+    // Number of packets in the batch that were received before this event
+    public readonly uint ReceivesBefore;
+}
+
+[StructLayout(LayoutKind.Sequential)]
+internal unsafe struct ReceiveQueue
+{
+    public ReceivedPacket* Packets;
+    public NetEvent* Events;
+    public uint PacketsCapacity;
+    public uint EventsCapacity;
+    public uint PacketsLength;
+    public uint EventsLength;
+}
+
+// Data such as the compressed map, copied once and split into packets up
+// front, and streamed to any number of clients with NetHost.Stream without
+// copying it again. Streams that are still running keep the native copy
+// alive after the source is disposed.
+public partial class NetStreamSource : IDisposable
+{
+    private readonly IntPtr source;
+    private bool disposed = false;
+
+    // Bytes of data, not counting the packet ids framing each chunk
+    public int Length { get; }
+
+    internal IntPtr Handle
+    {
+        get
+        {
+            ObjectDisposedException.ThrowIf(disposed, this);
+            return source;
+        }
+    }
+
+    private NetStreamSource(IntPtr source, int length)
+    {
+        this.source = source;
+        Length = length;
+    }
+
+    public static unsafe NetStreamSource Create(byte packetId, ReadOnlySpan<byte> data, uint chunkSize)
+    {
+        IntPtr source;
+        fixed (byte *d = data)
+        {
+            source = net_stream_source_create(packetId, d, (uint)data.Length, chunkSize);
+        }
+        if (source == IntPtr.Zero)
+            throw new Exception("Failed to create stream source");
+        return new(source, data.Length);
+    }
+
+    // Another handle to the same data, for passing the source to another
+    // thread. Every handle is disposed separately and the data is freed
+    // with the last one.
+    public NetStreamSource Retain()
+    {
+        return new(net_stream_source_retain(Handle), Length);
+    }
+
+    public void Dispose()
+    {
+        if (disposed)
+            return;
+        net_stream_source_release(source);
+        disposed = true;
+    }
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static unsafe partial IntPtr net_stream_source_create(byte packetId, byte *data, uint len, uint chunkSize);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial IntPtr net_stream_source_retain(IntPtr source);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial void net_stream_source_release(IntPtr source);
+}
+
+// Hosts whose stats can be read together from any thread, for running
+// several hosts on their own ports and network threads. Hosts leave the
+// registry when disposed and the registry must be disposed last.
+public partial class NetRegistry : IDisposable
+{
+    internal readonly IntPtr registry;
+    private bool disposed = false;
+
+    private NetRegistry(IntPtr registry)
+    {
+        this.registry = registry;
+    }
+
+    public static NetRegistry Create()
+    {
+        IntPtr registry = net_registry_create();
+        if (registry == IntPtr.Zero)
+            throw new Exception("Failed to create registry");
+        return new(registry);
+    }
+
+    public unsafe int GetHosts(Span<HostSummary> hosts)
+    {
+        fixed (HostSummary *h = hosts)
+        {
+            return net_registry_get_hosts(registry, h, hosts.Length);
+        }
+    }
+
+    // hosts receives the id of each client's host and may be empty
+    public unsafe int GetAllStats(Span<PeerStats> stats, Span<uint> hosts)
+    {
+        if (!hosts.IsEmpty && hosts.Length < stats.Length)
+            throw new ArgumentException("Not enough room for the host ids", nameof(hosts));
+        fixed (PeerStats *s = stats)
+        fixed (uint *h = hosts)
+        {
+            return net_registry_get_all_stats(registry, s, h, stats.Length);
+        }
+    }
+
+    // Stops every network thread at once instead of one after another. Must
+    // be called from the thread polling the hosts.
+    public void StopThreads()
+    {
+        net_registry_stop_threads(registry);
+    }
+
+    public void Dispose()
+    {
+        if (disposed)
+            return;
+        net_registry_destroy(registry);
+        disposed = true;
+    }
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial IntPtr net_registry_create();
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial void net_registry_destroy(IntPtr registry);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static unsafe partial int net_registry_get_hosts(IntPtr registry, HostSummary *hosts, int n);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static unsafe partial int net_registry_get_all_stats(IntPtr registry, PeerStats *stats, uint *hosts, int n);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial void net_registry_stop_threads(IntPtr registry);
+}
+
 public partial class NetHost : IDisposable
 {
     private readonly IntPtr host;
@@ -52,6 +353,10 @@ public partial class NetHost : IDisposable
     private ConnectCallback? connectCallback = null;
     private ReceiveCallback? receiveCallback = null;
     private DisconnectCallback? disconnectCallback = null;
+    private StreamCallback? streamCallback = null;
+
+    private unsafe SendQueue* sendQueue = null;
+    private unsafe ReceiveQueue* receiveQueue = null;
 
     private NetHost(IntPtr host)
     {
@@ -108,6 +413,37 @@ public partial class NetHost : IDisposable
         }
     }
 
+    public void OnStream(Func<uint, NetEventType, uint, CallbackResult> callback)
+    {
+        streamCallback = Callback;
+        net_host_set_stream_callback(host, streamCallback);
+
+        CallbackResult Callback(uint client, NetEventType type, uint bytes)
+        {
+            return callback(client, type, bytes);
+        }
+    }
+
+    // Moves ENet to a native thread. PollEvents then only hands over what the
+    // thread has received and never blocks.
+    public void StartNetworkThread(TimeSpan serviceTimeout, uint queueSize = 4096)
+    {
+        if (net_host_start_thread(host, (uint)serviceTimeout.TotalMilliseconds, queueSize) != 0)
+            throw new Exception("Failed to start network thread");
+    }
+
+    public void StopNetworkThread()
+    {
+        net_host_stop_thread(host);
+    }
+
+    // Cuts a PollEvents waiting for packets short. Can be called from any
+    // thread, for example after queueing work for the polling thread.
+    public void Wake()
+    {
+        net_host_wake(host);
+    }
+
     public int PollEvents(TimeSpan timeout)
     {
         return net_host_poll_events(host, (uint)timeout.Milliseconds);
@@ -121,6 +457,180 @@ public partial class NetHost : IDisposable
         }
     }
 
+    // Payloads this large skip the send queue so they are only copied once
+    public const int DirectSendThreshold = 1024;
+
+    // Enables batched sending with room for the given number of packets and
+    // payload bytes between calls to FlushSends.
+    public unsafe void InitSendQueue(uint packets, uint bytes)
+    {
+        if (net_host_init_send_queue(host, packets, bytes) != 0)
+            throw new Exception("Failed to allocate send queue");
+        sendQueue = net_host_get_send_queue(host);
+    }
+
+    // The packet is sent on the next call to FlushSends. Falls back to
+    // SendPacket if the queue is not enabled or the packet does not fit.
+    // Large packets are sent right away after flushing the queue to keep
+    // the order.
+    public unsafe int QueuePacket(uint client, PacketFlags flags, ReadOnlySpan<byte> buffer)
+    {
+        if (sendQueue == null)
+            return SendPacket(client, flags, buffer);
+        if (buffer.Length >= DirectSendThreshold)
+        {
+            FlushSends();
+            return SendPacket(client, flags, buffer);
+        }
+        if (TryQueuePacket(client, flags, buffer))
+            return 0;
+        FlushSends();
+        if (TryQueuePacket(client, flags, buffer))
+            return 0;
+        return SendPacket(client, flags, buffer);
+    }
+
+    private unsafe bool TryQueuePacket(uint client, PacketFlags flags, ReadOnlySpan<byte> buffer)
+    {
+        SendQueue* q = sendQueue;
+        if (q->DescriptorsLength >= q->DescriptorsCapacity
+            || (uint)buffer.Length > q->DataCapacity - q->DataLength)
+        {
+            return false;
+        }
+
+        buffer.CopyTo(new Span<byte>(q->Data + q->DataLength, buffer.Length));
+        q->Descriptors[q->DescriptorsLength] = new SendDescriptor
+        {
+            Client = client,
+            Flags = (int)flags,
+            Offset = q->DataLength,
+            Length = (uint)buffer.Length
+        };
+        q->DescriptorsLength++;
+        q->DataLength += (uint)buffer.Length;
+        return true;
+    }
+
+    public int FlushSends()
+    {
+        return net_host_flush_sends(host);
+    }
+
+    // Makes PollEvents queue packets and connection events instead of calling
+    // the callbacks. They are read with Received/ReceivedEvents and freed
+    // with ReleaseReceives.
+    public unsafe void InitReceiveQueue(uint packets, uint events)
+    {
+        if (net_host_init_recv_queue(host, packets, events) != 0)
+            throw new Exception("Failed to allocate receive queue");
+        receiveQueue = net_host_get_recv_queue(host);
+    }
+
+    public unsafe ReadOnlySpan<ReceivedPacket> Received =>
+        receiveQueue == null
+            ? ReadOnlySpan<ReceivedPacket>.Empty
+            : new(receiveQueue->Packets, (int)receiveQueue->PacketsLength);
+
+    public unsafe ReadOnlySpan<NetEvent> ReceivedEvents =>
+        receiveQueue == null
+            ? ReadOnlySpan<NetEvent>.Empty
+            : new(receiveQueue->Events, (int)receiveQueue->EventsLength);
+
+    public void ReleaseReceives()
+    {
+        net_host_release_receives(host);
+    }
+
+    public unsafe int Broadcast(ReadOnlySpan<uint> clients, PacketFlags flags, ReadOnlySpan<byte> buffer)
+    {
+        fixed (byte *b = buffer)
+        fixed (uint *c = clients)
+        {
+            return net_host_broadcast(host, (int)flags, b, buffer.Length, c, clients.Length);
+        }
+    }
+
+    public unsafe int BroadcastExcept(ReadOnlySpan<uint> except, PacketFlags flags, ReadOnlySpan<byte> buffer)
+    {
+        fixed (byte *b = buffer)
+        fixed (uint *e = except)
+        {
+            return net_host_broadcast_except(host, (int)flags, b, buffer.Length, e, except.Length);
+        }
+    }
+
+    // With a network thread these are from the last time it serviced ENet
+    public unsafe bool TryGetPeerStats(uint client, out PeerStats stats)
+    {
+        fixed (PeerStats *s = &stats)
+        {
+            return net_host_get_peer_stats(host, client, s) == 0;
+        }
+    }
+
+    // Fills stats with one entry per connected client and returns the count
+    public unsafe int GetAllStats(Span<PeerStats> stats)
+    {
+        fixed (PeerStats *s = stats)
+        {
+            return net_host_get_all_stats(host, s, stats.Length);
+        }
+    }
+
+    // Safe to call from any thread
+    public unsafe void GetCounters(out NetCounters counters)
+    {
+        fixed (NetCounters *c = &counters)
+        {
+            net_host_get_counters(host, c);
+        }
+    }
+
+    // Must be called before the network thread is started
+    public void Register(NetRegistry registry, uint id)
+    {
+        if (net_host_register(host, registry.registry, id) != 0)
+            throw new Exception("Failed to register host");
+    }
+
+    // Sends the source to the client a few chunks at a time as the client
+    // acknowledges them. Progress is reported through OnStream or the receive
+    // queue.
+    public int Stream(uint client, NetStreamSource source)
+    {
+        return net_host_stream(host, client, source.Handle);
+    }
+
+    public void SetStreamLimits(uint rate, uint peerWindow, uint hostWindow)
+    {
+        if (net_host_set_stream_limits(host, rate, peerWindow, hostWindow) != 0)
+            throw new Exception("Failed to set stream limits");
+    }
+
+    // Packets over the limits are dropped natively and never reach the game.
+    // A rate or max size of zero means no limit. Must be set before the
+    // network thread is started.
+    public void SetPacketLimit(byte id, uint rate, uint burst, uint maxSize)
+    {
+        if (net_host_set_packet_limit(host, id, rate, burst, maxSize) != 0)
+            throw new Exception("Failed to set packet limit");
+    }
+
+    public void SetPeerLimit(uint rate, uint burst)
+    {
+        if (net_host_set_peer_limit(host, rate, burst) != 0)
+            throw new Exception("Failed to set peer limit");
+    }
+
+    // Clients breaking the limits this many times within the window are
+    // disconnected. Zero violations never disconnects.
+    public void SetViolationLimit(uint violations, TimeSpan window)
+    {
+        if (net_host_set_violation_limit(host, violations, (uint)window.TotalMilliseconds) != 0)
+            throw new Exception("Failed to set violation limit");
+    }
+
     public void Dispose()
     {
         if (disposed)
@@ -150,9 +660,72 @@ public partial class NetHost : IDisposable
     [LibraryImport(LibSharpSpades.LibraryName)]
     internal static partial IntPtr net_host_set_disconnect_callback(IntPtr host, DisconnectCallback callback);
 
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial IntPtr net_host_set_stream_callback(IntPtr host, StreamCallback callback);
+
     [LibraryImport(LibSharpSpades.LibraryName)]
     internal static partial int net_host_poll_events(IntPtr host, uint serviceTimeoutMs);
 
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial void net_host_wake(IntPtr host);
+
     [LibraryImport(LibSharpSpades.LibraryName)]
     internal static unsafe partial int net_host_send_packet(IntPtr host, uint client, int flags, byte *buffer, int buffer_len);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static unsafe partial int net_host_broadcast(IntPtr host, int flags, byte *buffer, int buffer_len, uint *clients, int n);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static unsafe partial int net_host_broadcast_except(IntPtr host, int flags, byte *buffer, int buffer_len, uint *except, int n);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial int net_host_init_send_queue(IntPtr host, uint descs, uint bytes);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static unsafe partial SendQueue* net_host_get_send_queue(IntPtr host);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial int net_host_flush_sends(IntPtr host);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial int net_host_init_recv_queue(IntPtr host, uint packets, uint events);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static unsafe partial ReceiveQueue* net_host_get_recv_queue(IntPtr host);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial void net_host_release_receives(IntPtr host);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial int net_host_start_thread(IntPtr host, uint serviceTimeoutMs, uint queueSize);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial void net_host_stop_thread(IntPtr host);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static unsafe partial int net_host_get_peer_stats(IntPtr host, uint client, PeerStats *stats);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static unsafe partial int net_host_get_all_stats(IntPtr host, PeerStats *stats, int n);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static unsafe partial void net_host_get_counters(IntPtr host, NetCounters *counters);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial int net_host_stream(IntPtr host, uint client, IntPtr source);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial int net_host_set_stream_limits(IntPtr host, uint rate, uint peerWindow, uint hostWindow);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial int net_host_register(IntPtr host, IntPtr registry, uint id);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial int net_host_set_packet_limit(IntPtr host, byte id, uint rate, uint burst, uint maxSize);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial int net_host_set_peer_limit(IntPtr host, uint rate, uint burst);
+
+    [LibraryImport(LibSharpSpades.LibraryName)]
+    internal static partial int net_host_set_violation_limit(IntPtr host, uint violations, uint windowMs);
 }
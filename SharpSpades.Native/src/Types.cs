@@ -27,6 +27,22 @@ public struct Vec3f
     public float Z { get; set; }
 }
 
+[StructLayout(LayoutKind.Sequential)]
+public struct Vec3i
+{
+    public int X { get; set; }
+    public int Y { get; set; }
+    public int Z { get; set; }
+}
+
+// Max is inclusive
+[StructLayout(LayoutKind.Sequential)]
+public struct Box
+{
+    public Vec3f Min { get; set; }
+    public Vec3f Max { get; set; }
+}
+
 [StructLayout(LayoutKind.Explicit)]
 public readonly struct Block
 {
@@ -59,3 +75,71 @@ public struct Grenade
     public Vec3f Position { get; set; }
     public Vec3f Velocity { get; set; }
 }
+
+[StructLayout(LayoutKind.Sequential)]
+public struct ShotResult
+{
+    public int Player { get; }
+    public HitType Part { get; }
+    public float Distance { get; }
+}
+
+[StructLayout(LayoutKind.Sequential)]
+public struct ExplosionHit
+{
+    public int Player { get; }
+    public int Damage { get; }
+}
+
+// Why a block can't be placed, see validate_placements
+[Flags]
+public enum PlacementError : byte
+{
+    None = 0,
+    Invalid = 1 << 0,
+    NotAdjacent = 1 << 1,
+    Occupied = 1 << 2,
+    OutOfReach = 1 << 3
+}
+
+[StructLayout(LayoutKind.Sequential)]
+public struct MovementPolicy
+{
+    public float Tolerance { get; set; }
+    // Move corrected players only back to the tolerance instead of all the way
+    public int Clamp { get; set; }
+}
+
+[StructLayout(LayoutKind.Sequential)]
+public struct MovementCorrection
+{
+    public uint Player { get; }
+    public Vec3f Position { get; }
+    public float Error { get; }
+    public uint Violations { get; }
+}
+
+public static class WorldUpdate
+{
+    public const int MaxPlayers = 32;
+    public const int EntrySize = 24;
+    public const int Size = 1 + MaxPlayers * EntrySize;
+}
+
+[StructLayout(LayoutKind.Sequential)]
+public unsafe struct WorldUpdatePlayers
+{
+    public Vec3f* Positions;
+    public Vec3f* Orientations;
+    public byte* Active;
+    public int Count;
+}
+
+[StructLayout(LayoutKind.Sequential)]
+public struct WorldUpdatePolicy
+{
+    public float NearDistance { get; set; }
+    public float FarDistance { get; set; }
+    public int FarInterval { get; set; }
+    public int HideOccluded { get; set; }
+}
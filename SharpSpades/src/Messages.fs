@@ -6,6 +6,7 @@ namespace SharpSpades
 
 open SharpSpades.Net
 open SharpSpades.World
+open SharpSpades.Native.Net
 
 /// Messages sent to supervisor by worlds
 type SupervisorMessage =
@@ -13,6 +14,9 @@ type SupervisorMessage =
     | WorldStopping of WorldId
     | WorldStopped of WorldId
     | SendPacket of WorldId * ClientId * PacketFlags * Packet
+    /// Streams the source to the client, paced by its acknowledgements. The
+    /// message owns the source and the supervisor disposes it.
+    | StreamData of WorldId * ClientId * NetStreamSource
 
 /// Messages sent to worlds by supervisor
 type WorldMessage =
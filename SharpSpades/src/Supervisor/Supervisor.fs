@@ -26,10 +26,28 @@ type SupervisorOptions = {
 
 type ClientInfo = {
     ProtocolVersion : ProtocolVersion
-    mutable Stats : ClientStats
+    /// None until the stats have been read once
+    mutable Stats : ClientStats option
     mutable World : WorldId option
 }
 
+/// Wakes the network poll when a world posts a message, so its packets are
+/// sent right away instead of after the poll timeout
+type internal WakingWriter<'T>(inner : ChannelWriter<'T>, wake : unit -> unit) =
+    inherit ChannelWriter<'T>()
+
+    override _.TryWrite(item) =
+        let written = inner.TryWrite(item)
+        if written then
+            wake ()
+        written
+
+    override _.WaitToWriteAsync(cancellationToken) =
+        inner.WaitToWriteAsync(cancellationToken)
+
+    override _.TryComplete(error) =
+        inner.TryComplete(error)
+
 type Supervisor(scope : IServiceScope, opts : SupervisorOptions) as this =
     let services = scope.ServiceProvider
 
@@ -51,6 +69,14 @@ type Supervisor(scope : IServiceScope, opts : SupervisorOptions) as this =
 
     let port = opts.Port |> Option.defaultValue 32887 |> uint16
     let host = NetHost.CreateListener(AddressType.IPv4, port, 32u, 1u)
+    // Outgoing packets are batched and sent once per loop iteration
+    do host.InitSendQueue(4096u, 1u <<< 20)
+    // Floods are dropped before they reach the game and persistent
+    // offenders are kicked
+    do
+        host.SetPeerLimit(1000u, 2000u)
+        host.SetPacketLimit(byte PacketType.ChatMessage, 10u, 20u, 259u)
+        host.SetViolationLimit(50u, TimeSpan.FromSeconds(10.0))
 
     let eventManager = EventManager(logger)
     do
@@ -65,10 +91,31 @@ type Supervisor(scope : IServiceScope, opts : SupervisorOptions) as this =
         | true, client -> Some client
         | false, _ -> None
 
+    let toClientStats (stats : PeerStats) = {
+        Address = stats.EndPoint
+        IncomingBandwidth = stats.IncomingBandwidth
+        OutgoingBandwidth = stats.OutgoingBandwidth
+        PacketLoss = stats.PacketLoss
+        RoundTripTime = stats.RoundTripTime
+        RoundTripTimeVariance = stats.RoundTripTimeVariance
+        PacketThrottle = stats.PacketThrottle
+        ReliableDataInTransit = stats.ReliableDataInTransit
+    }
+
+    let peerStats = Array.zeroCreate<PeerStats> 32
+
+    // Reads the stats of every client with one native call
+    let updateStats () =
+        let count = host.GetAllStats(Span(peerStats))
+        for i in 0 .. count - 1 do
+            match tryFindClient peerStats[i].Client with
+            | Some client -> client.Stats <- Some (toClientStats peerStats[i])
+            | None -> ()
+
     let sendPacket client flags (packet : Packet) =
         match tryFindClient client with
         | Some _ ->
-            match host.SendPacket(client, flags, packet.Buffer) with
+            match host.QueuePacket(client, flags, ReadOnlySpan(packet.Buffer, 0, packet.Size + 1)) with
             | 0 -> Ok ()
             | _ -> Error "Failed to send packet"
         | None ->
@@ -77,15 +124,15 @@ type Supervisor(scope : IServiceScope, opts : SupervisorOptions) as this =
     let handleConnect clientId version =
         let ev = { Version = version }
         Supervisor.fireEvent this ev
+        // With a network thread the published stats can lag behind the
+        // connect, in which case the next updateStats fills them in
+        let stats =
+            match host.TryGetPeerStats(clientId) with
+            | true, stats -> Some (toClientStats stats)
+            | false, _ -> None
         clients.Add(clientId, {
             ProtocolVersion = version
-            Stats = {
-                Address = System.Net.IPEndPoint(System.Net.IPAddress.Any, 32887)
-                IncomingBandwidth = 0u
-                OutgoingBandwidth = 0u
-                PacketLoss = 0u
-                RoundTripTime = 0u
-            }
+            Stats = stats
             World = None
         })
         logger.LogInformation("Client {ClientId} connected", clientId)
@@ -133,7 +180,7 @@ type Supervisor(scope : IServiceScope, opts : SupervisorOptions) as this =
             let world = World(services.CreateScope(), {
                     Id = "main"
                     Messages = Channel.CreateUnbounded()
-                    Output = messages.Writer
+                    Output = WakingWriter(messages.Writer, fun () -> host.Wake()) :> ChannelWriter<_>
                     CancellationToken = opts.CancellationToken
                     Plugins = opts.Plugins
                 })
@@ -151,12 +198,22 @@ type Supervisor(scope : IServiceScope, opts : SupervisorOptions) as this =
             host.OnDisconnect (fun (client : ClientId) ty ->
                 handleDisconnect client ty
                 CallbackResult.Continue)
+            host.OnStream (fun (client : ClientId) ty bytes ->
+                match ty with
+                | NetEventType.StreamComplete ->
+                    logger.LogInformation("Sent {Bytes} bytes of map data to client {ClientId}",
+                        bytes, client)
+                | _ ->
+                    logger.LogDebug("Client {ClientId} has received {Bytes} bytes of map data",
+                        client, bytes)
+                CallbackResult.Continue)
 
             logger.LogInformation("Listening on port {Port}", port)
             try
                 while not opts.CancellationToken.IsCancellationRequested do
                     if host.PollEvents(TimeSpan.FromMilliseconds(50L)) < 0 then
                         logger.LogWarning("Failed to poll network events")
+                    updateStats ()
 
                     let mutable messagesRead = 0
                     while messagesRead < 50 && messages.Reader.Count > 0 do
@@ -187,10 +244,37 @@ type Supervisor(scope : IServiceScope, opts : SupervisorOptions) as this =
                                             clientId, reason)
                                 packet.RemoveRef()
                                 ()
+                            | StreamData (worldId, clientId, source) ->
+                                try
+                                    match tryFindClient clientId with
+                                    | Some client when client.World = Some worldId ->
+                                        if host.Stream(clientId, source) <> 0 then
+                                            logger.LogWarning("Failed to start streaming to client {ClientId}",
+                                                clientId)
+                                    | _ ->
+                                        logger.LogWarning(
+                                            "World {Sender} tried to stream data to client {ClientId} but the client is not in the world",
+                                            worldId, clientId)
+                                finally
+                                    // The stream holds its own reference
+                                    source.Dispose()
                         messagesRead <- messagesRead + 1
 
+                    if host.FlushSends() < 0 then
+                        logger.LogWarning("Failed to flush queued packets")
+
                 logger.LogInformation("Stopping")
             finally
+                // Sends still queued in ENet are flushed before the socket
+                // is closed
+                host.Dispose()
+                // Release the sources of streams that never started
+                let mutable draining = true
+                while draining do
+                    match messages.Reader.TryRead() with
+                    | true, StreamData (_, _, source) -> source.Dispose()
+                    | true, _ -> ()
+                    | false, _ -> draining <- false
                 logger.LogDebug("Stopped")
         }
 
@@ -210,4 +294,4 @@ type Supervisor(scope : IServiceScope, opts : SupervisorOptions) as this =
             ()
 
         member _.GetClientStats (arg: ClientId): ClientStats option =
-            raise (NotImplementedException())
+            tryFindClient arg |> Option.bind (fun c -> c.Stats)
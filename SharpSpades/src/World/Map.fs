@@ -6,6 +6,7 @@ open SharpSpades.Native
 
 module Map =
     open System.Buffers
+    open FSharp.NativeInterop
     type Map = {
         NativePtr : IntPtr
     }
@@ -14,9 +15,9 @@ module Map =
         | IOError of IO.IOError
         | OutOfMemory
 
-    let loadMap path =
+    let loadMapWithStorage storage path =
         async {
-            let ptr = LibSharpSpades.map_create()
+            let ptr = LibSharpSpades.map_create_with_storage(storage)
             if ptr = IntPtr.Zero then
                 return Error OutOfMemory
             else
@@ -28,21 +29,45 @@ module Map =
                     return Error (IOError err)
         }
 
+    let loadMap path = loadMapWithStorage MapStorage.Full path
+
+    // Most maps are 2-3 MB encoded
+    let private encodeBufferSize = 4 * 1024 * 1024
+
+    // Encodes the map into a pooled buffer and lends it to f without
+    // copying. The memory must not be used after f returns.
     let processEncodedMap f map =
+        let arr = ArrayPool<byte>.Shared.Rent(encodeBufferSize)
         let writer = MapWriter()
         use w = fixed &writer
-        if LibSharpSpades.map_writer_init(w) <> 0 then
+        use a = fixed arr
+        LibSharpSpades.map_writer_init_buffer(w, a, arr.Length)
+        try
+            if LibSharpSpades.map_write(map.NativePtr, w) <> 0 then
+                Error OutOfMemory
+            elif writer.Owned = 0 then
+                f (ReadOnlyMemory(arr, 0, writer.BufferLength)) |> Ok
+            else
+                // The map did not fit and the writer has its own buffer
+                use memory = new NativeMemoryManager(writer.Buffer, writer.BufferLength)
+                f (Memory<byte>.op_Implicit memory.Memory : ReadOnlyMemory<byte>) |> Ok
+        finally
+            LibSharpSpades.map_writer_deinit(w)
+            ArrayPool<byte>.Shared.Return(arr)
+
+    // Compresses the encoded map into a zlib stream using every core. The
+    // level goes from 1 (fastest) to 9 (smallest).
+    let compress level (encoded : ReadOnlyMemory<byte>) =
+        use data = encoded.Pin()
+        let mutable output = NativePtr.nullPtr<byte>
+        let mutable outputLen = 0un
+        if LibSharpSpades.compress_parallel(NativePtr.ofVoidPtr data.Pointer, unativeint encoded.Length,
+                level, 0, &&output, &&outputLen) <> 0 then
             Error OutOfMemory
         else
-            LibSharpSpades.map_write(map.NativePtr, w)
-            let span = ReadOnlySpan<byte>(writer.Buffer.ToPointer(), writer.BufferLength)
-            let arr = ArrayPool<byte>.Shared.Rent(writer.BufferLength)
-            span.CopyTo(arr)
-            let mem = ReadOnlyMemory(arr)
             try
-                f (mem.Slice(0, writer.BufferLength))
+                ReadOnlySpan<byte>(NativePtr.toVoidPtr output, int outputLen).ToArray()
+                |> Ok
             finally
-                ArrayPool<byte>.Shared.Return(arr)
-                LibSharpSpades.map_writer_deinit(w)
-            |> Ok
+                LibSharpSpades.compress_free(output)
 
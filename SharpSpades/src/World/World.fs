@@ -6,7 +6,6 @@ namespace SharpSpades.World
 
 open System
 open System.IO
-open System.IO.Compression
 open System.Collections.Generic
 open System.Threading
 open System.Threading.Channels
@@ -17,6 +16,7 @@ open Serilog
 open SharpSpades
 open SharpSpades.Plugins
 open SharpSpades.Net
+open SharpSpades.Native.Net
 open SharpSpades.World
 
 type WorldOptions = {
@@ -55,7 +55,7 @@ type World(scope : IServiceScope, opts : WorldOptions) as this =
     let eventManager = EventManager(logger)
 
     let mutable map = None
-    let mutable compressedMap = Unchecked.defaultof<_>
+    let mutable mapSource = Unchecked.defaultof<NetStreamSource>
     let clients = List<WorldClient>()
 
     let tryFindClient id =
@@ -75,6 +75,20 @@ type World(scope : IServiceScope, opts : WorldOptions) as this =
         SendPacket (opts.Id, clientId, PacketFlags.Unsequenced, packet)
         |> sendSupervisor
 
+    // Clients joining after this get the new map. Streams already running
+    // and StreamData messages still on their way hold their own references
+    // and finish sending the map they started with.
+    let replaceMapSource (compressedMap : byte[]) =
+        let old = mapSource
+        mapSource <- NetStreamSource.Create(byte PacketType.MapChunk,
+            ReadOnlySpan(compressedMap), 8u * 1024u)
+        if not (obj.ReferenceEquals(old, null)) then
+            old.Dispose()
+
+    // 9 compresses best. Compression runs on every core so this costs
+    // tens of milliseconds, lower it if map changes need to be faster.
+    let mapCompressionLevel = 9
+
     let mutable running = false
 
     member _.Messages = opts.Messages
@@ -128,24 +142,19 @@ type World(scope : IServiceScope, opts : WorldOptions) as this =
             let res =
                 Option.get map
                 |> Map.processEncodedMap (fun memory ->
-                    // TODO: This needs to happen on a separate thread because
-                    // it takes 800 ms to compress the map on SmallestSize (my computer).
-                    // Encoding the map also takes 100+ ms so we need a way to
-                    // do it concurrently as well. We need to copy the map buffer
-                    // to do so.
+                    // TODO: Encoding the map takes 100+ ms and should happen
+                    // concurrently as well.
                     logger.LogInformation("Encoding map took {Time} ms", sw.ElapsedMilliseconds)
-                    use output = new MemoryStream()
-                    let compressionLevel = CompressionLevel.SmallestSize
-                    use deflateStream = new DeflateStream(output, compressionLevel)
-                    deflateStream.Write(memory.Span)
-                    let res = output.ToArray()
-                    logger.LogInformation("Original size of map: {Original} Compressed size of map: {Compressed} Compression level: {CompressionLevel}",
-                        memory.Length, output.Length, compressionLevel)
+                    let res = Map.compress mapCompressionLevel memory
+                    res |> Result.iter (fun compressed ->
+                        logger.LogInformation("Original size of map: {Original} Compressed size of map: {Compressed} Compression level: {CompressionLevel}",
+                            memory.Length, compressed.Length, mapCompressionLevel))
                     res)
+                |> Result.bind id
             sw.Stop()
             match res with
             | Ok c ->
-                compressedMap <- c
+                replaceMapSource c
                 logger.LogInformation("Encoded and compressed map in {Milliseconds} ms",
                     sw.ElapsedMilliseconds)
             | Error err ->
@@ -154,6 +163,7 @@ type World(scope : IServiceScope, opts : WorldOptions) as this =
                 // TODO: Need to inform supervisor
                 return ()
 
+            use _ = { new IDisposable with member _.Dispose() = mapSource.Dispose() }
             while not opts.CancellationToken.IsCancellationRequested do
                 let hasMsg, msg = input.TryRead()
                 if hasMsg then
@@ -165,17 +175,17 @@ type World(scope : IServiceScope, opts : WorldOptions) as this =
                         let client = WorldClient(clientId)
                         clients.Add(client)
                         logger.LogInformation("Client {ClientId} connected", clientId)
-                        Packets.makeMapStart (uint compressedMap.Length)
+                        Packets.makeMapStart (uint mapSource.Length)
                             |> sendReliablePacket clientId
-                        let chunkSize = 8 * 1024
-                        let mutable rest = ReadOnlyMemory<byte>(compressedMap)
-                        while rest.Length > 0 do
-                            let size = min rest.Length chunkSize
-                            let chunk =
-                                Packets.makeMapChunk (rest.Span.Slice(0, size))
-                            sendReliablePacket clientId chunk
-                            rest <- rest.Slice(size)
-                        logger.LogInformation("Sent all map chunks to {ClientId}", clientId)
+                        // The chunks are sent as the client acknowledges them
+                        // so joining players don't flood the connection. The
+                        // message gets its own reference since mapSource may
+                        // be replaced or disposed before the supervisor gets
+                        // to it.
+                        let source = mapSource.Retain()
+                        if not (opts.Output.TryWrite(StreamData (opts.Id, clientId, source))) then
+                            source.Dispose()
+                        logger.LogInformation("Streaming map to {ClientId}", clientId)
                         ()
                     | PacketReceived (clientId, packet) ->
                         match tryFindClient clientId with
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2025 JStalnac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "compress.h"
+
+/*
+ * Input per block. Smaller blocks spread better over threads, larger ones
+ * lose less to restarting the compressor.
+ */
+#define COMPRESS_BLOCK_SIZE (128 * 1024)
+#define COMPRESS_DICT_SIZE (32 * 1024)
+#define COMPRESS_MAX_THREADS 64
+
+struct compress_block
+{
+	uint8_t *out;
+	size_t out_len;
+	uLong adler;
+};
+
+struct compress_job
+{
+	const uint8_t *data;
+	size_t len;
+	int level;
+	size_t blocks_len;
+	struct compress_block *blocks;
+	atomic_size_t next;
+	atomic_bool failed;
+};
+
+/*
+ * Every block but the last ends with a sync flush so it finishes on a byte
+ * boundary and the blocks can simply be concatenated.
+ */
+static int
+compress_block(struct compress_job *job, z_stream *zs, size_t i)
+{
+	struct compress_block *b = &job->blocks[i];
+	size_t start, n, capacity;
+	uint8_t *out;
+	int flush, ret;
+
+	start = i * COMPRESS_BLOCK_SIZE;
+	n = job->len - start < COMPRESS_BLOCK_SIZE ? job->len - start : COMPRESS_BLOCK_SIZE;
+	flush = i + 1 == job->blocks_len ? Z_FINISH : Z_SYNC_FLUSH;
+
+	if (deflateReset(zs) != Z_OK)
+		return -1;
+	if (start > 0) {
+		size_t dict = start < COMPRESS_DICT_SIZE ? start : COMPRESS_DICT_SIZE;
+		if (deflateSetDictionary(zs, job->data + start - dict, (uInt)dict) != Z_OK)
+			return -1;
+	}
+
+	// The bound is for Z_FINISH, a sync flush marker takes a few bytes more
+	capacity = deflateBound(zs, (uLong)n) + 16;
+	if (!(b->out = malloc(capacity)))
+		return -1;
+
+	zs->next_in = (Bytef *)(job->data + start);
+	zs->avail_in = (uInt)n;
+	zs->next_out = b->out;
+	zs->avail_out = (uInt)capacity;
+	for (;;) {
+		ret = deflate(zs, flush);
+		if (ret == Z_STREAM_ERROR)
+			return -1;
+		if (flush == Z_FINISH ? ret == Z_STREAM_END
+		                      : zs->avail_in == 0 && zs->avail_out > 0)
+			break;
+		if (zs->avail_out > 0)
+			continue;
+		if (!(out = realloc(b->out, capacity * 2)))
+			return -1;
+		b->out = out;
+		zs->next_out = b->out + capacity;
+		zs->avail_out = (uInt)capacity;
+		capacity *= 2;
+	}
+	b->out_len = capacity - zs->avail_out;
+	b->adler = adler32(1L, job->data + start, (uInt)n);
+	return 0;
+}
+
+static void *
+compress_worker(void *arg)
+{
+	struct compress_job *job = arg;
+	z_stream zs;
+	size_t i;
+
+	memset(&zs, 0, sizeof(zs));
+	// Raw deflate, the zlib header and checksum are added once around
+	// all the blocks
+	if (deflateInit2(&zs, job->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		atomic_store(&job->failed, true);
+		return NULL;
+	}
+
+	while (!atomic_load_explicit(&job->failed, memory_order_relaxed)) {
+		i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+		if (i >= job->blocks_len)
+			break;
+		if (compress_block(job, &zs, i) != 0)
+			atomic_store(&job->failed, true);
+	}
+
+	deflateEnd(&zs);
+	return NULL;
+}
+
+static int
+compress_join(struct compress_job *job, uint8_t **out, size_t *out_len)
+{
+	unsigned int header;
+	uLong adler;
+	size_t i, len;
+	uint8_t *o;
+
+	len = 2 + 4;
+	for (i = 0; i < job->blocks_len; i++)
+		len += job->blocks[i].out_len;
+	if (!(o = malloc(len)))
+		return -1;
+	*out = o;
+	*out_len = len;
+
+	// 32 KiB window, deflate and the level hint, as zlib writes it
+	header = (Z_DEFLATED + (7 << 4)) << 8;
+	header |= (job->level < 2 ? 0 : job->level < 6 ? 1 : job->level == 6 ? 2 : 3) << 6;
+	header += 31 - header % 31;
+	*o++ = (uint8_t)(header >> 8);
+	*o++ = (uint8_t)header;
+
+	adler = 1L;
+	for (i = 0; i < job->blocks_len; i++) {
+		memcpy(o, job->blocks[i].out, job->blocks[i].out_len);
+		o += job->blocks[i].out_len;
+		adler = i == 0 ? job->blocks[i].adler
+		               : adler32_combine(adler, job->blocks[i].adler,
+		                                 (z_off_t)(i + 1 == job->blocks_len
+		                                           ? job->len - i * COMPRESS_BLOCK_SIZE
+		                                           : COMPRESS_BLOCK_SIZE));
+	}
+	*o++ = (uint8_t)(adler >> 24);
+	*o++ = (uint8_t)(adler >> 16);
+	*o++ = (uint8_t)(adler >> 8);
+	*o++ = (uint8_t)adler;
+	return 0;
+}
+
+int
+compress_parallel(const uint8_t *data, size_t len, int level, int threads,
+                  uint8_t **out, size_t *out_len)
+{
+	pthread_t workers[COMPRESS_MAX_THREADS];
+	struct compress_job job;
+	int i, started, ret;
+	size_t b;
+
+	if ((len > 0 && !data) || !out || !out_len || level < 1 || level > 9)
+		return -1;
+
+	if (threads <= 0)
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (threads > COMPRESS_MAX_THREADS)
+		threads = COMPRESS_MAX_THREADS;
+
+	job.data = data;
+	job.len = len;
+	job.level = level;
+	// An empty input still needs one block to finish the stream
+	job.blocks_len = len == 0 ? 1 : (len + COMPRESS_BLOCK_SIZE - 1) / COMPRESS_BLOCK_SIZE;
+	if ((size_t)threads > job.blocks_len)
+		threads = (int)job.blocks_len;
+	if (!(job.blocks = calloc(job.blocks_len, sizeof(*job.blocks))))
+		return -1;
+	atomic_init(&job.next, 0);
+	atomic_init(&job.failed, false);
+
+	// The calling thread compresses too
+	started = 0;
+	for (i = 0; i < threads - 1; i++) {
+		if (pthread_create(&workers[i], NULL, compress_worker, &job) != 0)
+			break;
+		started++;
+	}
+	compress_worker(&job);
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i], NULL);
+
+	ret = -1;
+	if (!atomic_load(&job.failed))
+		ret = compress_join(&job, out, out_len);
+
+	for (b = 0; b < job.blocks_len; b++)
+		free(job.blocks[b].out);
+	free(job.blocks);
+	return ret;
+}
+
+void
+compress_free(uint8_t *data)
+{
+	free(data);
+}
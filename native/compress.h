@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2025 JStalnac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compresses data into a single zlib stream (RFC 1950) on several threads,
+ * the way pigz does. The input is split into blocks compressed
+ * independently, each primed with the 32 KiB of input before it so the
+ * ratio stays close to compressing in one go. level is the zlib level from
+ * 1 (fastest) to 9 (smallest), threads zero or less uses every core. The
+ * output is allocated with malloc and freed with compress_free.
+ */
+int compress_parallel(const uint8_t *data, size_t len, int level, int threads,
+                      uint8_t **out, size_t *out_len);
+void compress_free(uint8_t *);
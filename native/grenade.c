@@ -20,7 +20,9 @@
 #include <math.h>
 #include <stdlib.h>
 
+#include "hit_detection.h"
 #include "map.h"
+#include "pool.h"
 
 #include "grenade.h"
 
@@ -116,3 +118,94 @@ int move_grenade(struct map *map, struct grenade *g, float delta)
 	}
 	return ret;
 }
+
+int
+resolve_explosion(struct map *map, vec3f center, const vec3f *players, int n,
+                  struct explosion_hit *out_hits)
+{
+	float dx, dy, dz, d;
+	int i, hits;
+
+	if (!map || n < 0 || (n > 0 && (!players || !out_hits)))
+		return -1;
+
+	hits = 0;
+	for (i = 0; i < n; i++) {
+		dx = players[i].x - center.x;
+		dy = players[i].y - center.y;
+		dz = players[i].z - center.z;
+		// Cheap box test first so the ray is only cast for nearby players
+		if (fabsf(dx) >= GRENADE_DISTANCE || fabsf(dy) >= GRENADE_DISTANCE
+		    || fabsf(dz) >= GRENADE_DISTANCE)
+			continue;
+		if (!can_see(map, center.x, center.y, center.z,
+		             players[i].x, players[i].y, players[i].z))
+			continue;
+
+		// 4096 / d^2 like the original server, never zero inside the box
+		d = dx * dx + dy * dy + dz * dz;
+		out_hits[hits].player = i;
+		if (d * GRENADE_MAX_DAMAGE <= 4096.f)
+			out_hits[hits].damage = GRENADE_MAX_DAMAGE;
+		else
+			out_hits[hits].damage = (int) (4096.f / d);
+		hits++;
+	}
+	return hits;
+}
+
+struct resolve_explosions_ctx
+{
+	struct map *map;
+	const vec3f *centers;
+	const vec3f *players;
+	int n;
+	struct explosion_hit *out_hits;
+	int *out_counts;
+};
+
+static void
+resolve_explosions_task(void *arg, int i)
+{
+	struct resolve_explosions_ctx *ctx = arg;
+
+	ctx->out_counts[i] = resolve_explosion(ctx->map, ctx->centers[i],
+	                                       ctx->players, ctx->n,
+	                                       ctx->out_hits + (size_t)i * ctx->n);
+}
+
+int
+resolve_explosions(struct worker_pool *pool, struct map *map,
+                   const vec3f *centers, int count, const vec3f *players,
+                   int n, struct explosion_hit *out_hits, int *out_counts)
+{
+	struct resolve_explosions_ctx ctx;
+	int i, total;
+
+	if (!map || count < 0 || n < 0)
+		return -1;
+	if (count > 0 && (!centers || !out_counts))
+		return -1;
+	if (count > 0 && n > 0 && (!players || !out_hits))
+		return -1;
+
+	ctx.map = map;
+	ctx.centers = centers;
+	ctx.players = players;
+	ctx.n = n;
+	ctx.out_hits = out_hits;
+	ctx.out_counts = out_counts;
+
+	if (n == 0) {
+		for (i = 0; i < count; i++)
+			out_counts[i] = 0;
+		return 0;
+	}
+
+	worker_pool_run(pool, resolve_explosions_task, &ctx, count);
+
+	total = 0;
+	for (i = 0; i < count; i++)
+		total += out_counts[i];
+	return total;
+}
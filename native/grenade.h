@@ -15,7 +15,14 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "types.h"
+
+/* Explosions only reach players within this distance on every axis */
+#define GRENADE_DISTANCE 16
+#define GRENADE_MAX_DAMAGE 100
+
 struct map;
+struct worker_pool;
 
 struct grenade
 {
@@ -27,3 +34,39 @@ struct grenade *grenade_create(vec3f position, vec3f velocity);
 void grenade_destroy(struct grenade *);
 
 int move_grenade(struct map *, struct grenade*, float delta);
+
+struct explosion_hit
+{
+	int player; /* index into the players array */
+	int damage;
+};
+
+/*
+ * Finds the players hurt by a grenade exploding at center. Players have to be
+ * within GRENADE_DISTANCE of the center on every axis and visible from it
+ * (can_see). The damage falls off with the squared distance. out_hits must
+ * have room for n hits.
+ *
+ * Returns the number of hits or -1 on error.
+ */
+int resolve_explosion(struct map *,
+                      vec3f center,
+                      const vec3f *players,
+                      int n,
+                      struct explosion_hit *out_hits);
+
+/*
+ * Resolves several explosions at once, spread over the worker pool (may be
+ * NULL). The hits of explosion i are written to out_hits + i * n and their
+ * count to out_counts[i], so out_hits must have room for count * n hits.
+ *
+ * Returns the total number of hits or -1 on error.
+ */
+int resolve_explosions(struct worker_pool *,
+                       struct map *,
+                       const vec3f *centers,
+                       int count,
+                       const vec3f *players,
+                       int n,
+                       struct explosion_hit *out_hits,
+                       int *out_counts);
@@ -18,8 +18,11 @@
  */
 
 #include <math.h>
+#include <string.h>
 
 #include "map.h"
+#include "player.h"
+#include "pool.h"
 
 #include "hit_detection.h"
 
@@ -83,7 +86,86 @@ isvoxelsolidwrap(struct map *map, long x, long y, long z)
 		return 0;
 	else if (z >= 64)
 		return 1;
-	return map_is_solid(map, (int) x & VSIDM, (int) y & VSIDM, z);
+	x &= VSIDM;
+	y &= VSIDM;
+	return map_is_solid(map, x, y, z);
+}
+
+/*
+ * Returns the shift of the empty super brick or brick containing the voxel,
+ * or 0 if the voxel has to be looked at.
+ */
+static inline int
+empty_region(struct map *map, const vec3l *a)
+{
+	long x, y;
+
+	if (a->z < 0 || a->z >= 64)
+		return 0;
+	x = a->x & VSIDM;
+	y = a->y & VSIDM;
+	if (map->super_bricks[x >> MAP_SUPER_BRICK_SHIFT]
+	                     [y >> MAP_SUPER_BRICK_SHIFT]
+	                     [a->z >> MAP_SUPER_BRICK_SHIFT] == 0)
+		return MAP_SUPER_BRICK_SHIFT;
+	if (map->bricks[x >> MAP_BRICK_SHIFT]
+	               [y >> MAP_BRICK_SHIFT]
+	               [a->z >> MAP_BRICK_SHIFT] == 0)
+		return MAP_BRICK_SHIFT;
+	return 0;
+}
+
+static inline int
+in_region(const vec3l *a, const vec3l *r, int shift)
+{
+	return ((a->x & VSIDM) >> shift) == r->x
+	       && ((a->y & VSIDM) >> shift) == r->y
+	       && (a->z >> shift) == r->z;
+}
+
+static inline void
+step_ray(vec3l *a, const vec3l *c, const vec3l *d, vec3l *p, const vec3l *i)
+{
+	if (((p->x | p->y) >= 0) && (a->z != c->z)) {
+		a->z += d->z;
+		p->x -= i->x;
+		p->y -= i->y;
+	} else if ((p->z >= 0) && (a->x != c->x)) {
+		a->x += d->x;
+		p->x += i->z;
+		p->z -= i->y;
+	} else {
+		a->y += d->y;
+		p->y += i->z;
+		p->z += i->x;
+	}
+}
+
+/*
+ * Called with a in an empty region. Steps the ray until it leaves the region
+ * using only the error terms, so the map is not read for any of the voxels
+ * inside. The voxels visited are the same as stepping one by one. Returns 0
+ * if cnt runs out inside the region, otherwise a is the first voxel outside
+ * it and has not been counted yet.
+ */
+static inline int
+skip_empty(struct map *map, vec3l *a, const vec3l *c, const vec3l *d,
+           vec3l *p, const vec3l *i, long *cnt)
+{
+	vec3l r;
+	int shift;
+
+	while ((shift = empty_region(map, a))) {
+		r.x = (a->x & VSIDM) >> shift;
+		r.y = (a->y & VSIDM) >> shift;
+		r.z = a->z >> shift;
+		do {
+			if (!--*cnt)
+				return 0;
+			step_ray(a, c, d, p, i);
+		} while (in_region(a, &r, shift));
+	}
+	return 1;
 }
 
 long
@@ -150,20 +232,10 @@ can_see(struct map *map, float x0, float y0, float z0, float x1, float y1, float
 	if (cnt > 32)
 		cnt = 32;
 	while (cnt) {
-		if (((p.x | p.y) >= 0) && (a.z != c.z)) {
-			a.z += d.z;
-			p.x -= i.x;
-			p.y -= i.y;
-		} else if ((p.z >= 0) && (a.x != c.x)) {
-			a.x += d.x;
-			p.x += i.z;
-			p.z -= i.y;
-		} else {
-			a.y += d.y;
-			p.y += i.z;
-			p.z += i.x;
-		}
-
+		step_ray(&a, &c, &d, &p, &i);
+		// Most rays travel through open air, skip it a brick at a time
+		if (!skip_empty(map, &a, &c, &d, &p, &i, &cnt))
+			return 1;
 		if (isvoxelsolidwrap(map, a.x, a.y, a.z))
 			return 0;
 		cnt--;
@@ -241,20 +313,9 @@ cast_ray(struct map *map, vec3f from, vec3f direction, float length, vec3l *hit)
 	if (cnt > length)
 		cnt = (long) length;
 	while (cnt) {
-		if (((p.x | p.y) >= 0) && (a.z != c.z)) {
-			a.z += d.z;
-			p.x -= i.x;
-			p.y -= i.y;
-		} else if ((p.z >= 0) && (a.x != c.x)) {
-			a.x += d.x;
-			p.x += i.z;
-			p.z -= i.y;
-		} else {
-			a.y += d.y;
-			p.y += i.z;
-			p.z += i.x;
-		}
-
+		step_ray(&a, &c, &d, &p, &i);
+		if (!skip_empty(map, &a, &c, &d, &p, &i, &cnt))
+			return 0;
 		if (isvoxelsolidwrap(map, a.x, a.y, a.z)) {
 			hit->x = a.x;
 			hit->y = a.y;
@@ -265,3 +326,201 @@ cast_ray(struct map *map, vec3f from, vec3f direction, float length, vec3l *hit)
 	}
 	return 0;
 }
+
+struct can_see_matrix_ctx
+{
+	struct map *map;
+	const vec3f *positions;
+	int n;
+	float max_distance_sq;
+	size_t stride;
+	uint8_t *out;
+};
+
+/*
+ * Fills the upper triangle of row i. Each task only writes to its own row so
+ * tasks can run concurrently without sharing any bytes.
+ */
+static void
+can_see_matrix_row(void *arg, int i)
+{
+	struct can_see_matrix_ctx *ctx = arg;
+	const vec3f *a = &ctx->positions[i];
+	uint8_t *row = ctx->out + ctx->stride * i;
+	float dx, dy, dz;
+	int j;
+
+	for (j = i + 1; j < ctx->n; j++) {
+		const vec3f *b = &ctx->positions[j];
+
+		if (ctx->max_distance_sq > 0) {
+			dx = b->x - a->x;
+			dy = b->y - a->y;
+			dz = b->z - a->z;
+			if (dx * dx + dy * dy + dz * dz > ctx->max_distance_sq)
+				continue;
+		}
+
+		if (can_see(ctx->map, a->x, a->y, a->z, b->x, b->y, b->z))
+			row[j >> 3] |= 1 << (j & 7);
+	}
+}
+
+int
+can_see_matrix(struct worker_pool *pool, struct map *map,
+               const vec3f *positions, int n, float max_distance,
+               uint8_t *out)
+{
+	struct can_see_matrix_ctx ctx;
+	uint8_t *row;
+	int i, j;
+
+	if (!map || !out || n < 0 || (n > 0 && !positions))
+		return -1;
+
+	ctx.map = map;
+	ctx.positions = positions;
+	ctx.n = n;
+	ctx.max_distance_sq = max_distance > 0 ? max_distance * max_distance : 0;
+	ctx.stride = ((size_t)n + 7) / 8;
+	ctx.out = out;
+
+	memset(out, 0, ctx.stride * n);
+
+	// The last row has nothing above the diagonal
+	worker_pool_run(pool, can_see_matrix_row, &ctx, n - 1);
+
+	for (i = 0; i < n; i++) {
+		row = out + ctx.stride * i;
+		row[i >> 3] |= 1 << (i & 7);
+		for (j = i + 1; j < n; j++) {
+			if (row[j >> 3] & (1 << (j & 7)))
+				out[ctx.stride * j + (i >> 3)] |= 1 << (i & 7);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Hitboxes relative to the player position. Z points down, so the head is at
+ * the top and the feet are 2.25 blocks below the position when standing
+ * (0.9 less when crouching), like the hull in boxclipmove.
+ */
+struct hitbox
+{
+	enum hit_part part;
+	float half_width;
+	float top;
+	float bottom;
+	float crouch_top;
+	float crouch_bottom;
+};
+
+static const struct hitbox hitboxes[] = {
+	{ HIT_PART_HEAD,  0.35f, -0.45f, 0.35f, -0.45f, 0.35f },
+	{ HIT_PART_TORSO, 0.45f,  0.35f, 1.35f,  0.35f, 0.90f },
+	{ HIT_PART_LEGS,  0.45f,  1.35f, 2.25f,  0.90f, 1.35f },
+};
+
+/*
+ * Slab test, returns the distance along the ray where it enters the box or
+ * a negative value if it does not hit it within [0, max].
+ */
+static float
+ray_box(vec3f o, vec3f inv, vec3f lo, vec3f hi, float max)
+{
+	float t0 = 0, t1 = max, a, b, tmp;
+
+#define SLAB(c) \
+	a = (lo.c - o.c) * inv.c; \
+	b = (hi.c - o.c) * inv.c; \
+	if (a > b) { tmp = a; a = b; b = tmp; } \
+	if (a > t0) t0 = a; \
+	if (b < t1) t1 = b; \
+	if (t0 > t1) return -1;
+
+	SLAB(x)
+	SLAB(y)
+	SLAB(z)
+#undef SLAB
+
+	return t0;
+}
+
+int
+resolve_shot(struct map *map, const struct player *shooter, vec3f orientation,
+             float length, struct player *const *players, int n,
+             struct shot_result *out)
+{
+	const struct player *p;
+	const struct hitbox *box;
+	vec3f o, dir, inv, lo, hi, center;
+	vec3l voxel;
+	float f, t, best;
+	size_t k;
+	int i, crouching;
+
+	if (!map || !shooter || !out || n < 0 || (n > 0 && !players))
+		return -1;
+	if (!(length > 0))
+		return -1;
+
+	f = sqrtf(orientation.x * orientation.x + orientation.y * orientation.y
+	          + orientation.z * orientation.z);
+	if (!(f > 0) || !isfinite(f))
+		return -1;
+	dir.x = orientation.x / f;
+	dir.y = orientation.y / f;
+	dir.z = orientation.z / f;
+	// Division by zero gives infinities which the slab test handles
+	inv.x = 1.f / dir.x;
+	inv.y = 1.f / dir.y;
+	inv.z = 1.f / dir.z;
+	o = shooter->m.eyePos;
+
+	best = length;
+	if (cast_ray(map, o, dir, length, &voxel)) {
+		lo.x = voxel.x;
+		lo.y = voxel.y;
+		lo.z = voxel.z;
+		hi.x = voxel.x + 1;
+		hi.y = voxel.y + 1;
+		hi.z = voxel.z + 1;
+		if ((t = ray_box(o, inv, lo, hi, length)) < 0) {
+			// The DDA can report a voxel the exact ray only grazes,
+			// use the distance to its center instead
+			center.x = voxel.x + .5f - o.x;
+			center.y = voxel.y + .5f - o.y;
+			center.z = voxel.z + .5f - o.z;
+			t = center.x * dir.x + center.y * dir.y + center.z * dir.z;
+		}
+		if (t < best)
+			best = t;
+	}
+
+	out->player = -1;
+	for (i = 0; i < n; i++) {
+		p = players[i];
+		if (!p || p == shooter)
+			continue;
+		crouching = p->crouching;
+		for (k = 0; k < sizeof(hitboxes) / sizeof(hitboxes[0]); k++) {
+			box = &hitboxes[k];
+			lo.x = p->m.pos.x - box->half_width;
+			lo.y = p->m.pos.y - box->half_width;
+			lo.z = p->m.pos.z + (crouching ? box->crouch_top : box->top);
+			hi.x = p->m.pos.x + box->half_width;
+			hi.y = p->m.pos.y + box->half_width;
+			hi.z = p->m.pos.z + (crouching ? box->crouch_bottom : box->bottom);
+			if ((t = ray_box(o, inv, lo, hi, best)) < 0)
+				continue;
+			best = t;
+			out->player = i;
+			out->part = box->part;
+			out->distance = t;
+		}
+	}
+
+	return out->player >= 0;
+}
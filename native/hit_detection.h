@@ -18,6 +18,24 @@
 #include "types.h"
 
 struct map;
+struct player;
+struct worker_pool;
+
+/* Same values as the hit type in the Hit packet */
+enum hit_part
+{
+	HIT_PART_TORSO = 0,
+	HIT_PART_HEAD  = 1,
+	HIT_PART_ARMS  = 2,
+	HIT_PART_LEGS  = 3,
+};
+
+struct shot_result
+{
+	int player; /* index into the players array */
+	enum hit_part part;
+	float distance;
+};
 
 int validate_hit(vec3f shooter,
              vec3f orientation,
@@ -25,3 +43,35 @@ int validate_hit(vec3f shooter,
              float tolerance);
 long can_see(struct map *, float x0, float y0, float z0, float x1, float y1, float z1);
 long cast_ray(struct map *, vec3f from, vec3f direction, float length, vec3l *hit);
+
+/*
+ * Computes can_see between every pair of positions. The result is a bit matrix
+ * of n rows, each (n + 7) / 8 bytes long, where bit (j % 8) of byte
+ * out[i * ((n + 7) / 8) + j / 8] is set if i and j can see each other. Only
+ * can_see(positions[i], positions[j]) with i < j is evaluated and the result
+ * is mirrored to (j, i). Pairs further apart than max_distance are not
+ * visible, a max_distance of zero or less disables the cutoff. Every
+ * position can see itself. The pool may be NULL to do all the work on the calling thread.
+ */
+int can_see_matrix(struct worker_pool *,
+                   struct map *,
+                   const vec3f *positions,
+                   int n,
+                   float max_distance,
+                   uint8_t *out);
+
+/*
+ * Traces a shot from the shooter's eye position along orientation and finds
+ * the closest body part hitbox it goes through among the players. Hits
+ * behind the first solid voxel (cast_ray) or beyond length are ignored, as
+ * are the shooter itself and NULL entries.
+ *
+ * Returns 1 and fills out if a player was hit, 0 on a miss and -1 on error.
+ */
+int resolve_shot(struct map *,
+                 const struct player *shooter,
+                 vec3f orientation,
+                 float length,
+                 struct player *const *players,
+                 int n,
+                 struct shot_result *out);
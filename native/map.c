@@ -26,14 +26,112 @@
 
 #include "map.h"
 
+/* Twice the largest palette keeps probe sequences short */
+#define MAP_PALETTE_LOOKUP_SIZE (2 * MAP_PALETTE_MAX)
+#define MAP_VOXELS ((size_t)MAP_X * MAP_Y * MAP_Z)
+
+static inline size_t
+map_index(int x, int y, int z)
+{
+	return ((size_t)x * MAP_Y + y) * MAP_Z + z;
+}
+
+static inline uint32_t
+map_palette_hash(block b)
+{
+	return (b * 2654435761u) & (MAP_PALETTE_LOOKUP_SIZE - 1);
+}
+
+static void
+map_free_palette(struct map *m)
+{
+	free(m->indices);
+	free(m->solid);
+	free(m->palette);
+	free(m->palette_lookup);
+	m->indices = NULL;
+	m->solid = NULL;
+	m->palette = NULL;
+	m->palette_lookup = NULL;
+	m->palette_len = 0;
+}
+
+/* Returns the palette index of b, adding it if needed, or -1 if it is full */
+static int32_t
+map_palette_index(struct map *m, block b)
+{
+	uint32_t h;
+
+	for (h = map_palette_hash(b); m->palette_lookup[h] != 0;
+	     h = (h + 1) & (MAP_PALETTE_LOOKUP_SIZE - 1)) {
+		if (m->palette[m->palette_lookup[h] - 1] == b)
+			return (int32_t)m->palette_lookup[h] - 1;
+	}
+
+	if (m->palette_len == MAP_PALETTE_MAX)
+		return -1;
+	m->palette[m->palette_len] = b;
+	m->palette_lookup[h] = ++m->palette_len;
+	if (b == AIR)
+		m->air_index = m->palette_len - 1;
+	return (int32_t)m->palette_len - 1;
+}
+
+/* Expands a paletted map into full blocks once the palette is full */
+static int
+map_convert_to_full(struct map *m)
+{
+	size_t i;
+	block *blocks;
+
+	if (!(blocks = malloc(sizeof(*blocks) * MAP_VOXELS)))
+		return -1;
+	for (i = 0; i < MAP_VOXELS; i++)
+		blocks[i] = m->palette[m->indices[i]];
+	m->blocks = (block (*)[MAP_Y][MAP_Z])blocks;
+	map_free_palette(m);
+	m->storage = MAP_STORAGE_FULL;
+	return 0;
+}
+
 struct map *
-map_create()
+map_create_with_storage(enum map_storage storage)
 {
 	struct map *m;
 
-	if (!(m = malloc(sizeof(*m))))
+	// The brick counts are updated incrementally by map_set, so everything
+	// has to start out as empty
+	if (!(m = calloc(1, sizeof(*m))))
 		return NULL;
+	m->storage = storage;
+
+	if (storage == MAP_STORAGE_FULL) {
+		if (!(m->blocks = calloc(MAP_VOXELS, sizeof(block))))
+			goto fail;
+		return m;
+	}
+
+	m->indices = calloc(MAP_VOXELS, sizeof(*m->indices));
+	m->solid = calloc(MAP_VOXELS / 64, sizeof(*m->solid));
+	m->palette = malloc(sizeof(*m->palette) * MAP_PALETTE_MAX);
+	m->palette_lookup = calloc(MAP_PALETTE_LOOKUP_SIZE, sizeof(*m->palette_lookup));
+	if (!m->indices || !m->solid || !m->palette || !m->palette_lookup)
+		goto fail;
+	// Index 0 is what every voxel starts as, the same zero block a full
+	// map starts with
+	m->air_index = MAP_PALETTE_MAX;
+	map_palette_index(m, 0);
 	return m;
+
+fail:
+	map_destroy(m);
+	return NULL;
+}
+
+struct map *
+map_create()
+{
+	return map_create_with_storage(MAP_STORAGE_FULL);
 }
 
 void
@@ -41,6 +139,8 @@ map_destroy(struct map *m)
 {
 	if (!m)
 		return;
+	free(m->blocks);
+	map_free_palette(m);
 	free(m);
 }
 
@@ -107,42 +207,76 @@ map_writer_init(struct map_writer *w)
 
 	memset(w, 0, sizeof(*w));
 
-	if (!(w->buffer = malloc(sizeof(w->buffer) * cap))) {
+	if (!(w->buffer = malloc(cap))) {
 		return -1;
 	}
 	w->capacity = cap;
 	w->len = 0;
+	w->owned = 1;
 	return 0;
 }
 
+void
+map_writer_init_buffer(struct map_writer *w, uint8_t *buffer, int capacity)
+{
+	memset(w, 0, sizeof(*w));
+	w->buffer = buffer;
+	w->capacity = buffer ? capacity : 0;
+	w->len = 0;
+	w->owned = 0;
+}
+
 void
 map_writer_deinit(struct map_writer *w)
 {
 	if (!w)
 		return;
-	free(w->buffer);
+	if (w->owned)
+		free(w->buffer);
 	memset(w, 0, sizeof(*w));
 	w->buffer = NULL;
 	w->capacity = 0;
 	w->len = 0;
 }
 
+static int
+map_writer_grow(struct map_writer *w)
+{
+	uint8_t *buffer;
+	int new_cap;
+
+	// Double the capacity, 64 MB is the maximum size of the encoded map
+	// at 512x512x64 size
+	new_cap = w->capacity > 0 ? w->capacity * 2 : 4 * 1024 * 1024;
+	if (w->capacity >= MAP_WRITER_MAX)
+		return -1;
+	if (new_cap > MAP_WRITER_MAX)
+		new_cap = MAP_WRITER_MAX;
+
+	if (w->owned) {
+		if (!(buffer = realloc(w->buffer, new_cap)))
+			return -1;
+	} else {
+		// Outgrew the caller's buffer, which stays theirs
+		if (!(buffer = malloc(new_cap)))
+			return -1;
+		if (w->len > 0)
+			memcpy(buffer, w->buffer, w->len);
+		w->owned = 1;
+	}
+	w->buffer = buffer;
+	w->capacity = new_cap;
+	return 0;
+}
+
 static void
 map_writer_write_byte(struct map_writer *w, uint8_t b)
 {
-	int new_len;
-
-	if (w->len >= w->capacity) {
-		new_len = w->capacity;
-		do {
-			// Double the length until the contents fit
-			new_len *= 2;
-
-			// 64 MB is the maximum size of the encoded map at
-			// 512x512x64 size
-			assert(new_len <= 64 * 1024 * 1024);
-		} while (new_len <= w->len);
-		assert((w->buffer = realloc(w->buffer, new_len)) != NULL);
+	if (w->failed)
+		return;
+	if (w->len >= w->capacity && map_writer_grow(w) != 0) {
+		w->failed = 1;
+		return;
 	}
 
 	w->buffer[w->len++] = b;
@@ -158,7 +292,7 @@ map_writer_write_color(struct map_writer *w, uint32_t color)
 	map_writer_write_byte(w, (uint8_t) (color >> 24));
 }
 
-void
+int
 map_write(const struct map *m, struct map_writer *w)
 {
 	int i, j, k;
@@ -241,39 +375,177 @@ map_write(const struct map *m, struct map_writer *w)
 			}
 		}
 	}
+	return w->failed ? -1 : 0;
 }
 
 void
 map_set(struct map *m, uint16_t x, uint16_t y, uint16_t z, block b)
 {
-	m->blocks[x][y][z] = b;
+	int delta;
+	int32_t index;
+	size_t i;
+
+	delta = ((b & COLOR_MASK) != 0) - map_is_solid(m, x, y, z);
+
+	if (m->storage == MAP_STORAGE_PALETTE) {
+		i = map_index(x, y, z);
+		// Out of palette entries, keep going with full blocks. If even
+		// that fails the voxel keeps its old value.
+		if ((index = map_palette_index(m, b)) < 0) {
+			if (map_convert_to_full(m) != 0)
+				return;
+			m->blocks[x][y][z] = b;
+		} else {
+			m->indices[i] = (uint16_t)index;
+			if (b & COLOR_MASK)
+				m->solid[i >> 6] |= (uint64_t)1 << (i & 63);
+			else
+				m->solid[i >> 6] &= ~((uint64_t)1 << (i & 63));
+		}
+	} else {
+		m->blocks[x][y][z] = b;
+	}
+	if (delta == 0)
+		return;
+
+	m->bricks[x >> MAP_BRICK_SHIFT]
+	         [y >> MAP_BRICK_SHIFT]
+	         [z >> MAP_BRICK_SHIFT] += delta;
+	m->super_bricks[x >> MAP_SUPER_BRICK_SHIFT]
+	               [y >> MAP_SUPER_BRICK_SHIFT]
+	               [z >> MAP_SUPER_BRICK_SHIFT] += delta;
 }
 
 block
 map_get(const struct map *m, uint16_t x, uint16_t y, uint16_t z)
 {
+	if (m->storage == MAP_STORAGE_PALETTE)
+		return m->palette[m->indices[map_index(x, y, z)]];
 	return m->blocks[x][y][z];
 }
 
 int
 map_is_solid(const struct map *m, uint16_t x, uint16_t y, uint16_t z)
 {
+	size_t i;
+
+	if (m->storage == MAP_STORAGE_PALETTE) {
+		i = map_index(x, y, z);
+		return (m->solid[i >> 6] >> (i & 63)) & 1;
+	}
 	return (m->blocks[x][y][z] & COLOR_MASK) != 0;
 }
 
+/* Exactly AIR, which is not the same as not solid */
+static inline int
+map_is_air(const struct map *m, int x, int y, int z)
+{
+	if (m->storage == MAP_STORAGE_PALETTE)
+		return m->indices[map_index(x, y, z)] == m->air_index;
+	return m->blocks[x][y][z] == AIR;
+}
+
 int
 map_is_surface(const struct map *m, uint16_t x, uint16_t y, uint16_t z)
 {
-	if (m->blocks[x][y][z] == AIR) return false;
-	if (x     > 0     && m->blocks[x - 1][y][z] == AIR) return true;
-	if (x + 1 < MAP_X && m->blocks[x + 1][y][z] == AIR) return true;
-	if (y     > 0     && m->blocks[x][y - 1][z] == AIR) return true;
-	if (y + 1 < MAP_Y && m->blocks[x][y + 1][z] == AIR) return true;
-	if (z     > 0     && m->blocks[x][y][z - 1] == AIR) return true;
-	if (z + 1 < MAP_Z && m->blocks[x][y][z + 1] == AIR) return true;
+	if (map_is_air(m, x, y, z)) return false;
+	if (x     > 0     && map_is_air(m, x - 1, y, z)) return true;
+	if (x + 1 < MAP_X && map_is_air(m, x + 1, y, z)) return true;
+	if (y     > 0     && map_is_air(m, x, y - 1, z)) return true;
+	if (y + 1 < MAP_Y && map_is_air(m, x, y + 1, z)) return true;
+	if (z     > 0     && map_is_air(m, x, y, z - 1)) return true;
+	if (z + 1 < MAP_Z && map_is_air(m, x, y, z + 1)) return true;
 	return false;
 }
 
+int
+map_clipbox(const struct map *m, float x, float y, float z)
+{
+	int sz;
+
+	if (x < 0 || x >= MAP_X || y < 0 || y >= MAP_Y)
+		return 1;
+	else if (z < 0)
+		return 0;
+	sz = (int) z;
+	if (sz == 63)
+		sz = 62;
+	else if (sz >= 64)
+		return 1;
+	return map_is_solid(m, (int) x, (int) y, sz);
+}
+
+/* Whether the column has solid voxels from z0 to z1, both inside the map */
+static int
+map_column_solid(const struct map *m, int x, int y, int z0, int z1)
+{
+	uint64_t mask;
+	int z;
+
+	// A column of solid bits is exactly one word
+	if (m->storage == MAP_STORAGE_PALETTE) {
+		mask = (z1 == 63 ? ~(uint64_t)0 : ((uint64_t)1 << (z1 + 1)) - 1)
+		       & ~(((uint64_t)1 << z0) - 1);
+		return (m->solid[(size_t)x * MAP_Y + y] & mask) != 0;
+	}
+
+	for (z = z0; z <= z1; z++) {
+		if (map_is_empty_brick(m, x, y, z)) {
+			z |= (1 << MAP_BRICK_SHIFT) - 1;
+			continue;
+		}
+		if (m->blocks[x][y][z] & COLOR_MASK)
+			return 1;
+	}
+	return 0;
+}
+
+static int
+map_box_clear(const struct map *m, const box *b)
+{
+	int x, y, x0, x1, y0, y1, z0, z1;
+
+	if (b->min.x < 0 || b->max.x >= MAP_X || b->min.y < 0 || b->max.y >= MAP_Y
+	    || b->max.z >= MAP_Z)
+		return 0;
+	if (b->max.z < 0)
+		return 1;
+
+	x0 = (int) b->min.x;
+	x1 = (int) b->max.x;
+	y0 = (int) b->min.y;
+	y1 = (int) b->max.y;
+	z0 = b->min.z < 0 ? 0 : (int) b->min.z;
+	z1 = (int) b->max.z;
+	if (z0 == MAP_Z - 1)
+		z0 = MAP_Z - 2;
+	if (z1 == MAP_Z - 1)
+		z1 = MAP_Z - 2;
+
+	for (x = x0; x <= x1; x++) {
+		for (y = y0; y <= y1; y++) {
+			if (map_column_solid(m, x, y, z0, z1))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+int
+map_boxes_clear(const struct map *m, const box *boxes, int n, uint8_t *out)
+{
+	int i, clear;
+
+	if (!m || n < 0 || (n > 0 && (!boxes || !out)))
+		return -1;
+
+	clear = 0;
+	for (i = 0; i < n; i++) {
+		out[i] = (uint8_t)map_box_clear(m, &boxes[i]);
+		clear += out[i];
+	}
+	return clear;
+}
 
 /*
  *  Copyright (c) Mathias Kaerlev 2011-2012.
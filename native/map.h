@@ -38,28 +38,112 @@
  */
 typedef uint32_t block;
 
+/*
+ * Coarse occupancy of the map, the number of solid voxels in every 4x4x4
+ * brick and 16x16x16 super brick. Kept up to date by map_set so ray walkers
+ * can skip the voxel lookup for empty space.
+ */
+#define MAP_BRICK_SHIFT 2
+#define MAP_SUPER_BRICK_SHIFT 4
+
+/*
+ * With MAP_STORAGE_PALETTE every voxel is a 16-bit index into a palette of
+ * the distinct block values in the map, and solidity is kept in a separate
+ * bit per voxel. Real maps use a few thousand colors, so this takes about
+ * half the memory of storing blocks. map_get returns exactly the values
+ * that were set either way. A map that runs out of palette entries
+ * switches to MAP_STORAGE_FULL by itself.
+ */
+enum map_storage {
+	MAP_STORAGE_FULL = 0,
+	MAP_STORAGE_PALETTE = 1
+};
+
+#define MAP_PALETTE_MAX 65536
+
 struct map {
-	block blocks[MAP_X][MAP_Y][MAP_Z];
+	enum map_storage storage;
+
+	/* MAP_STORAGE_FULL */
+	block (*blocks)[MAP_Y][MAP_Z];
+
+	/* MAP_STORAGE_PALETTE */
+	uint16_t *indices; /* MAP_X * MAP_Y * MAP_Z, x major like blocks */
+	uint64_t *solid;   /* one bit per voxel in the same order */
+	block *palette;
+	uint32_t palette_len;
+	uint32_t *palette_lookup; /* open addressing, palette index + 1 */
+	uint32_t air_index; /* palette index of AIR, MAP_PALETTE_MAX if none */
+
+	uint8_t bricks[MAP_X >> MAP_BRICK_SHIFT]
+	              [MAP_Y >> MAP_BRICK_SHIFT]
+	              [MAP_Z >> MAP_BRICK_SHIFT];
+	uint16_t super_bricks[MAP_X >> MAP_SUPER_BRICK_SHIFT]
+	                     [MAP_Y >> MAP_SUPER_BRICK_SHIFT]
+	                     [MAP_Z >> MAP_SUPER_BRICK_SHIFT];
 };
 
+/*
+ * Buffer for the encoded map. It is either allocated by the writer or
+ * borrowed from the caller with map_writer_init_buffer. A writer outgrowing
+ * a borrowed buffer copies it into one of its own and leaves the caller's
+ * untouched after that, owned tells which one buffer is. The contents stay
+ * valid until map_writer_deinit.
+ */
+#define MAP_WRITER_MAX (64 * 1024 * 1024)
+
 struct map_writer {
 	uint8_t *buffer;
 	int capacity;
 	int len;
+	int owned;
+	int failed; /* growing the buffer failed, the output is incomplete */
 };
 
 struct map *map_create();
+struct map *map_create_with_storage(enum map_storage);
 void map_destroy(struct map *);
 
 void map_load(struct map *, const uint8_t *v, int len);
 
 int map_writer_init(struct map_writer *);
+void map_writer_init_buffer(struct map_writer *, uint8_t *buffer, int capacity);
 void map_writer_deinit(struct map_writer *);
-void map_write(const struct map *, struct map_writer *);
+/* Returns -1 if the buffer could not grow to fit the map */
+int map_write(const struct map *, struct map_writer *);
 
 void map_set(struct map *, uint16_t x, uint16_t y, uint16_t z, block b);
 block map_get(const struct map *, uint16_t x, uint16_t y, uint16_t z);
 int map_is_solid(const struct map *, uint16_t x, uint16_t y, uint16_t z);
 int map_is_surface(const struct map *, uint16_t x, uint16_t y, uint16_t z);
 
+/*
+ * Returns non-zero if the brick containing the voxel has no solid voxels.
+ * The coordinates must be inside the map.
+ */
+static inline int
+map_is_empty_brick(const struct map *m, int x, int y, int z)
+{
+	return m->super_bricks[x >> MAP_SUPER_BRICK_SHIFT]
+	                      [y >> MAP_SUPER_BRICK_SHIFT]
+	                      [z >> MAP_SUPER_BRICK_SHIFT] == 0
+	       || m->bricks[x >> MAP_BRICK_SHIFT]
+	                   [y >> MAP_BRICK_SHIFT]
+	                   [z >> MAP_BRICK_SHIFT] == 0;
+}
+
+/*
+ * Collision rules of player movement for a single point: outside the map
+ * horizontally and below the bottom is solid, above the top is empty and
+ * the bottom layer counts as the one above it.
+ */
+int map_clipbox(const struct map *, float x, float y, float z);
+/*
+ * Sets out[i] to 1 if no point of boxes[i] is solid by the rules of
+ * map_clipbox and to 0 otherwise.
+ *
+ * Returns the number of clear boxes or -1 on error.
+ */
+int map_boxes_clear(const struct map *, const box *boxes, int n, uint8_t *out);
+
 int map_block_line(const vec3i* v1, const vec3i* v2, vec3i* result);
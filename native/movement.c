@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2025 JStalnac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "player.h"
+#include "pool.h"
+
+#include "movement.h"
+
+struct movement_entry
+{
+	struct player state;
+	bool active;
+
+	bool has_keys;
+	uint8_t keys;
+	bool has_orientation;
+	vec3f orientation;
+	bool has_report;
+	vec3f report;
+
+	uint32_t violations;
+
+	/* Result of the last tick, filled in by the workers */
+	bool corrected;
+	float error;
+};
+
+struct movement_verifier
+{
+	int n;
+	struct movement_entry *entries;
+};
+
+struct movement_verifier *
+movement_verifier_create(int players)
+{
+	struct movement_verifier *v;
+
+	if (players <= 0)
+		return NULL;
+	if (!(v = malloc(sizeof(*v))))
+		return NULL;
+	if (!(v->entries = calloc(players, sizeof(*v->entries)))) {
+		free(v);
+		return NULL;
+	}
+	v->n = players;
+	return v;
+}
+
+void
+movement_verifier_destroy(struct movement_verifier *v)
+{
+	if (!v)
+		return;
+	free(v->entries);
+	free(v);
+}
+
+int
+movement_verifier_reset(struct movement_verifier *v, int player,
+                        const struct player *state)
+{
+	struct movement_entry *e;
+
+	if (!v || !state || player < 0 || player >= v->n)
+		return -1;
+
+	e = &v->entries[player];
+	memset(e, 0, sizeof(*e));
+	e->state = *state;
+	e->active = true;
+	return 0;
+}
+
+void
+movement_verifier_remove(struct movement_verifier *v, int player)
+{
+	if (!v || player < 0 || player >= v->n)
+		return;
+	memset(&v->entries[player], 0, sizeof(v->entries[player]));
+}
+
+static struct movement_entry *
+get_active(struct movement_verifier *v, int player)
+{
+	if (!v || player < 0 || player >= v->n || !v->entries[player].active)
+		return NULL;
+	return &v->entries[player];
+}
+
+int
+movement_verifier_input(struct movement_verifier *v, int player, uint8_t keys)
+{
+	struct movement_entry *e;
+
+	if (!(e = get_active(v, player)))
+		return -1;
+	e->keys = keys;
+	e->has_keys = true;
+	return 0;
+}
+
+int
+movement_verifier_orientation(struct movement_verifier *v, int player,
+                              vec3f orientation)
+{
+	struct movement_entry *e;
+
+	if (!(e = get_active(v, player)))
+		return -1;
+	// Rejected here so a NaN never reaches the simulation
+	if (!isfinite(orientation.x) || !isfinite(orientation.y)
+	    || !isfinite(orientation.z))
+		return -1;
+	e->orientation = orientation;
+	e->has_orientation = true;
+	return 0;
+}
+
+int
+movement_verifier_report(struct movement_verifier *v, int player,
+                         vec3f position)
+{
+	struct movement_entry *e;
+
+	if (!(e = get_active(v, player)))
+		return -1;
+	e->report = position;
+	e->has_report = true;
+	return 0;
+}
+
+static void
+apply_keys(struct player *p, uint8_t keys)
+{
+	// Same as Player.SetInputs on the managed side
+	p->movForward = !!(keys & MOVEMENT_KEY_UP);
+	p->movBackwards = !!(keys & MOVEMENT_KEY_DOWN);
+	p->movLeft = !!(keys & MOVEMENT_KEY_LEFT);
+	p->movRight = !!(keys & MOVEMENT_KEY_RIGHT);
+	p->jumping = !!(keys & MOVEMENT_KEY_JUMP);
+	p->crouching = !!(keys & MOVEMENT_KEY_CROUCH);
+	p->sneaking = !!(keys & MOVEMENT_KEY_SNEAK);
+	p->sprinting = !!(keys & MOVEMENT_KEY_SPRINT);
+}
+
+struct movement_tick_ctx
+{
+	struct movement_verifier *v;
+	struct map *map;
+	float delta;
+	float time;
+	const struct movement_policy *policy;
+};
+
+static void
+movement_tick_task(void *arg, int i)
+{
+	struct movement_tick_ctx *ctx = arg;
+	struct movement_entry *e = &ctx->v->entries[i];
+	struct player *p = &e->state;
+	float dx, dy, dz, d, f;
+
+	e->corrected = false;
+	if (!e->active)
+		return;
+
+	if (e->has_orientation)
+		player_set_orientation(p, e->orientation);
+	if (e->has_keys)
+		apply_keys(p, e->keys);
+	e->has_orientation = false;
+	e->has_keys = false;
+
+	move_player(ctx->map, p, ctx->delta, ctx->time);
+
+	if (!e->has_report)
+		return;
+	e->has_report = false;
+
+	dx = e->report.x - p->m.pos.x;
+	dy = e->report.y - p->m.pos.y;
+	dz = e->report.z - p->m.pos.z;
+	d = sqrtf(dx * dx + dy * dy + dz * dz);
+
+	// A non-finite report fails the comparison and is always corrected
+	if (d <= ctx->policy->tolerance) {
+		p->m.pos = p->m.eyePos = e->report;
+		e->violations = 0;
+		return;
+	}
+
+	if (ctx->policy->clamp && isfinite(d)) {
+		f = ctx->policy->tolerance / d;
+		p->m.pos.x += dx * f;
+		p->m.pos.y += dy * f;
+		p->m.pos.z += dz * f;
+		p->m.eyePos = p->m.pos;
+	}
+	e->corrected = true;
+	e->error = d;
+	e->violations++;
+}
+
+int
+movement_verifier_tick(struct movement_verifier *v, struct worker_pool *pool,
+                       struct map *map, float delta, float time,
+                       const struct movement_policy *policy,
+                       struct movement_correction *out)
+{
+	struct movement_tick_ctx ctx;
+	struct movement_entry *e;
+	int i, count;
+
+	if (!v || !map || !policy || !out)
+		return -1;
+	if (!(policy->tolerance >= 0))
+		return -1;
+
+	ctx.v = v;
+	ctx.map = map;
+	ctx.delta = delta;
+	ctx.time = time;
+	ctx.policy = policy;
+	worker_pool_run(pool, movement_tick_task, &ctx, v->n);
+
+	// Packed on this thread so the corrections come out ordered by player
+	count = 0;
+	for (i = 0; i < v->n; i++) {
+		e = &v->entries[i];
+		if (!e->corrected)
+			continue;
+		out[count].player = (uint32_t) i;
+		out[count].position = e->state.m.pos;
+		out[count].error = e->error;
+		out[count].violations = e->violations;
+		count++;
+	}
+	return count;
+}
+
+int
+movement_verifier_get(const struct movement_verifier *v, int player,
+                      struct player *out)
+{
+	if (!v || !out || player < 0 || player >= v->n
+	    || !v->entries[player].active)
+		return -1;
+	*out = v->entries[player].state;
+	return 0;
+}
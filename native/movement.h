@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2025 JStalnac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "types.h"
+
+struct map;
+struct player;
+struct worker_pool;
+
+/* Bits of the input byte, in the order of the InputData packet */
+#define MOVEMENT_KEY_UP     (1 << 0)
+#define MOVEMENT_KEY_DOWN   (1 << 1)
+#define MOVEMENT_KEY_LEFT   (1 << 2)
+#define MOVEMENT_KEY_RIGHT  (1 << 3)
+#define MOVEMENT_KEY_JUMP   (1 << 4)
+#define MOVEMENT_KEY_CROUCH (1 << 5)
+#define MOVEMENT_KEY_SNEAK  (1 << 6)
+#define MOVEMENT_KEY_SPRINT (1 << 7)
+
+struct movement_policy
+{
+	/* Reports further than this from the simulated position are corrected */
+	float tolerance;
+	/*
+	 * Zero to send the player back to the simulated position, otherwise the
+	 * player is only moved back to tolerance away from it along the line to
+	 * the reported position.
+	 */
+	int clamp;
+};
+
+struct movement_correction
+{
+	uint32_t player;
+	vec3f position; /* where the player is now according to the server */
+	float error;    /* distance between the report and the simulation */
+	uint32_t violations; /* corrections in a row, including this one */
+};
+
+/*
+ * Keeps the authoritative movement state of every player and checks the
+ * positions they report against it. Inputs and reports are queued between
+ * ticks, only the latest of each is used.
+ */
+struct movement_verifier;
+
+struct movement_verifier *movement_verifier_create(int players);
+void movement_verifier_destroy(struct movement_verifier *);
+
+/*
+ * Starts verifying a player from the given state, e.g. on spawn or after
+ * the server moved the player. Returns -1 if the id is out of range.
+ */
+int movement_verifier_reset(struct movement_verifier *, int player,
+                            const struct player *state);
+/* Stops verifying a player, such as on death or disconnect */
+void movement_verifier_remove(struct movement_verifier *, int player);
+
+/* Returns -1 if the id is out of range or the player is not verified */
+int movement_verifier_input(struct movement_verifier *, int player,
+                            uint8_t keys);
+int movement_verifier_orientation(struct movement_verifier *, int player,
+                                  vec3f orientation);
+int movement_verifier_report(struct movement_verifier *, int player,
+                             vec3f position);
+
+/*
+ * Moves every verified player with move_player, spread over the worker pool
+ * (may be NULL), and compares the reported positions with the result.
+ * Reports within the tolerance are taken as the new position, the others
+ * produce a correction. out must have room for as many corrections as the
+ * verifier has players.
+ *
+ * Returns the number of corrections or -1 on error.
+ */
+int movement_verifier_tick(struct movement_verifier *,
+                           struct worker_pool *,
+                           struct map *,
+                           float delta,
+                           float time,
+                           const struct movement_policy *,
+                           struct movement_correction *out);
+
+/* Copies the authoritative state of a player, -1 if it is not verified */
+int movement_verifier_get(const struct movement_verifier *, int player,
+                          struct player *out);
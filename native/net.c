@@ -15,23 +15,138 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
 #include <enet6/enet.h>
 
 #include "types.h"
 #include "net.h"
+#include "ring.h"
 
 _Static_assert((int)ADDRESS_TYPE_ANY == (int)ENET_ADDRESS_TYPE_ANY, "ANY address types must match");
 _Static_assert((int)ADDRESS_TYPE_IPV4 == (int)ENET_ADDRESS_TYPE_IPV4, "IPv4 address types must match");
 _Static_assert((int)ADDRESS_TYPE_IPV6 == (int)ENET_ADDRESS_TYPE_IPV6, "IPv6 address types must match");
 
+/*
+ * Client ids are the index of the client slot plus one in the low bits and
+ * the generation of the slot in the high bits. Finding a client is a direct
+ * array index and ids of disconnected clients never match a reused slot.
+ */
+#define CLIENT_SLOT_BITS 16
+#define CLIENT_SLOT_MASK ((1u << CLIENT_SLOT_BITS) - 1)
+#define CLIENT_SLOTS_MAX CLIENT_SLOT_MASK
+
+/* Chunks a stream may have queued in ENet and not yet acknowledged */
+#define NET_STREAM_MAX_CHUNKS 64
+
+#define NET_STREAM_DEFAULT_PEER_WINDOW (64 * 1024)
+#define NET_STREAM_DEFAULT_HOST_WINDOW (256 * 1024)
+
+/*
+ * The data is stored framed, every chunk_size bytes preceded by packet_id,
+ * so chunk packets can point straight into it. Each of those packets holds
+ * a reference.
+ */
+struct net_stream_source
+{
+	atomic_uint refs;
+	uint8_t packet_id;
+	uint32_t chunk_size;
+	uint32_t len; /* without the packet ids */
+	uint8_t data[];
+};
+
+/*
+ * Position of a client in a stream. ENet drops its reference to a reliable
+ * packet once the client has acknowledged it, so the chunks we still hold
+ * the only reference to are done.
+ */
+struct net_stream
+{
+	struct net_stream_source *source;
+	uint32_t cursor;   /* bytes of source data queued to ENet */
+	uint32_t reported; /* acknowledged bytes last reported to the game */
+	uint32_t in_flight_bytes; /* packet bytes of the chunks below */
+	int in_flight_len;
+	ENetPacket *in_flight[NET_STREAM_MAX_CHUNKS];
+};
+
+/* Tokens are in thousandths of a packet */
+struct token_bucket
+{
+	uint32_t tokens;
+	uint32_t last_ms;
+};
+
 struct client
 {
 	uint32_t id; /* 0 means not connected */
 	ENetPeer *peer;
+	uint16_t generation;
+	size_t next_free;
+	struct net_stream *stream;
+	/* Formatted once on connect */
+	char address[PEER_ADDRESS_LEN];
+
+	/* Receive limits, the per id buckets are in host->buckets */
+	struct token_bucket bucket;
+	uint32_t violations;
+	uint32_t violations_start_ms;
+	bool kicked;
+};
+
+/* Messages between the network thread and the game thread */
+enum
+{
+	NET_MSG_CONNECT,    /* data is ev->data */
+	NET_MSG_RECEIVE,
+	NET_MSG_DISCONNECT, /* data is the disconnect type */
+	NET_MSG_STREAM_PROGRESS, /* data is the acknowledged bytes */
+	NET_MSG_STREAM_COMPLETE, /* data is the length of the stream */
+	NET_MSG_SEND,
+	NET_MSG_RELEASE,    /* drop the game thread's reference to packet */
+	NET_MSG_STREAM      /* start streaming source */
+};
+
+struct net_message
+{
+	uint32_t type;
+	uint32_t client;
+	uint32_t data;
+	ENetPacket *packet;
+	struct net_stream_source *source;
+};
+
+/*
+ * Counters are updated from both threads with relaxed atomic adds and read
+ * without stopping either, so a snapshot is not an exact cut in time.
+ */
+struct net_packet_counters
+{
+	atomic_uint_least64_t packets_in;
+	atomic_uint_least64_t bytes_in;
+	atomic_uint_least64_t packets_out;
+	atomic_uint_least64_t bytes_out;
+	atomic_uint_least64_t drops;
+	atomic_uint_least64_t callback_ns;
+};
+
+struct net_host_counters
+{
+	struct net_packet_counters packets[NET_PACKET_IDS];
+	atomic_uint_least64_t poll_us[NET_HISTOGRAM_BUCKETS];
+	atomic_uint_least64_t service_us[NET_HISTOGRAM_BUCKETS];
 };
 
 struct host
@@ -41,16 +156,296 @@ struct host
 	connect_callback connect_callback;
 	receive_callback receive_callback;
 	disconnect_callback disconnect_callback;
+	stream_callback stream_callback;
 
-	/*
-	 * TODO: Consider sorting this array so we can do binary search instead
-	 * of linear search for finding client
-	 */
+	/* Owned by whichever thread services ENet */
 	struct client *clients;
 	size_t clients_len;
-	uint32_t next_client_id;
+	/* Head of the free slot list, clients_len when no slots are free */
+	size_t free_client;
+
+	struct send_queue sends;
+	struct recv_queue recvs;
+
+	/* Stream pacing, owned by whichever thread services ENet */
+	uint32_t stream_rate;
+	uint32_t stream_peer_window;
+	uint32_t stream_host_window;
+	uint32_t stream_in_flight; /* packet bytes over all streams */
+	int streams_len;
+	/* Slot to start the next round from so no stream is favoured */
+	size_t stream_next;
+
+	/*
+	 * With a network thread only that thread touches ENet. Events go to the
+	 * game thread through incoming and packets come back through outgoing.
+	 * The game thread tracks connected clients in connected, indexed by
+	 * slot, as it sees the connect and disconnect messages.
+	 */
+	bool threaded;
+	pthread_t thread;
+	atomic_bool stop;
+	uint32_t service_timeout_ms;
+	struct spsc_ring incoming;
+	struct spsc_ring outgoing;
+	uint32_t *connected;
+
+	struct net_host_counters counters;
+
+	/*
+	 * Limits on received packets, checked on the thread servicing ENet.
+	 * buckets holds NET_PACKET_IDS buckets per client slot and is only
+	 * allocated once a per id rate is set.
+	 */
+	struct packet_limit limits[NET_PACKET_IDS];
+	struct packet_limit peer_limit;
+	uint32_t violation_limit;
+	uint32_t violation_window_ms;
+	struct token_bucket *buckets;
+
+	/*
+	 * Polled together with the ENet socket so waiting for packets can be
+	 * cut short. wake_pending avoids a write for every wake while the
+	 * poller is busy anyway.
+	 */
+	int wake_fd;
+	atomic_bool wake_pending;
+
+	/* Peer stats published by the network thread, indexed by slot */
+	pthread_mutex_t stats_lock;
+	struct peer_stats *stats;
+
+	/* Set by net_host_register, the registry reads stats */
+	struct net_registry *registry;
+	uint32_t registry_id;
+};
+
+/*
+ * Hosts whose stats can be read from any thread. The lock is held while
+ * reading so a host can't be destroyed halfway through.
+ */
+struct net_registry
+{
+	pthread_mutex_t lock;
+	struct host **hosts;
+	size_t hosts_len;
+	size_t hosts_capacity;
 };
 
+/* ENet is initialised while any host exists */
+static pthread_mutex_t net_enet_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t net_enet_users;
+
+static void
+net_host_init_counters(struct net_host_counters *c)
+{
+	struct net_packet_counters *p;
+	size_t i;
+
+	for (i = 0; i < NET_PACKET_IDS; i++) {
+		p = &c->packets[i];
+		atomic_init(&p->packets_in, 0);
+		atomic_init(&p->bytes_in, 0);
+		atomic_init(&p->packets_out, 0);
+		atomic_init(&p->bytes_out, 0);
+		atomic_init(&p->drops, 0);
+		atomic_init(&p->callback_ns, 0);
+	}
+	for (i = 0; i < NET_HISTOGRAM_BUCKETS; i++) {
+		atomic_init(&c->poll_us[i], 0);
+		atomic_init(&c->service_us[i], 0);
+	}
+}
+
+static inline void
+net_counter_add(atomic_uint_least64_t *counter, uint64_t n)
+{
+	atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+/* The packet id is the first byte, empty packets are counted as id 0 */
+static inline struct net_packet_counters *
+net_host_packet_counters(struct host *host, const uint8_t *data, size_t len)
+{
+	return &host->counters.packets[len > 0 ? data[0] : 0];
+}
+
+static inline void
+net_host_count_drops(struct host *host, const uint8_t *data, size_t len,
+                     uint64_t n)
+{
+	net_counter_add(&net_host_packet_counters(host, data, len)->drops, n);
+}
+
+static inline uint64_t
+net_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void
+net_histogram_add(atomic_uint_least64_t *histogram, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int bucket = 0;
+
+	while (us > 0 && bucket < NET_HISTOGRAM_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+	net_counter_add(&histogram[bucket], 1);
+}
+
+static inline uint32_t
+client_id_make(size_t slot, uint16_t generation)
+{
+	return ((uint32_t)generation << CLIENT_SLOT_BITS) | (uint32_t)(slot + 1);
+}
+
+static inline size_t
+client_id_slot(uint32_t id)
+{
+	// An id of 0 wraps around to a slot that is out of bounds
+	return (size_t)((id & CLIENT_SLOT_MASK) - 1);
+}
+
+static struct client *
+net_host_find_client(struct host *host, uint32_t id)
+{
+	struct client *c;
+	size_t slot;
+
+	slot = client_id_slot(id);
+	if (slot >= host->clients_len)
+		return NULL;
+	c = &host->clients[slot];
+	if (c->id != id)
+		return NULL;
+	return c;
+}
+
+/* Whether the client is connected as far as the game thread knows */
+static bool
+net_host_knows_client(struct host *host, uint32_t id)
+{
+	size_t slot;
+
+	if (!host->threaded)
+		return net_host_find_client(host, id) != NULL;
+
+	slot = client_id_slot(id);
+	return slot < host->clients_len && host->connected[slot] == id;
+}
+
+static inline uint32_t
+net_host_client_at(struct host *host, size_t slot)
+{
+	if (host->threaded)
+		return host->connected[slot];
+	return host->clients[slot].id;
+}
+
+struct net_stream_source *
+net_stream_source_create(uint8_t packet_id, const uint8_t *data, uint32_t len,
+                         uint32_t chunk_size)
+{
+	struct net_stream_source *source;
+	uint32_t chunks, offset, n;
+	uint8_t *out;
+
+	if ((len > 0 && !data) || chunk_size == 0)
+		return NULL;
+
+	chunks = len / chunk_size + (len % chunk_size != 0);
+	if (!(source = malloc(sizeof(*source) + (size_t)len + chunks)))
+		return NULL;
+	atomic_init(&source->refs, 1);
+	source->packet_id = packet_id;
+	source->chunk_size = chunk_size;
+	source->len = len;
+
+	out = source->data;
+	for (offset = 0; offset < len; offset += n) {
+		n = len - offset < chunk_size ? len - offset : chunk_size;
+		*out++ = packet_id;
+		memcpy(out, data + offset, n);
+		out += n;
+	}
+	return source;
+}
+
+struct net_stream_source *
+net_stream_source_retain(struct net_stream_source *source)
+{
+	if (source)
+		atomic_fetch_add_explicit(&source->refs, 1, memory_order_relaxed);
+	return source;
+}
+
+void
+net_stream_source_release(struct net_stream_source *source)
+{
+	if (!source)
+		return;
+	if (atomic_fetch_sub_explicit(&source->refs, 1, memory_order_acq_rel) == 1)
+		free(source);
+}
+
+/* Free callback of chunk packets */
+static void
+net_stream_chunk_free(ENetPacket *packet)
+{
+	net_stream_source_release(packet->userData);
+}
+
+static void
+net_host_end_stream(struct host *host, struct client *c)
+{
+	struct net_stream *s = c->stream;
+	ENetPacket *packet;
+	int i;
+
+	if (!s)
+		return;
+
+	for (i = 0; i < s->in_flight_len; i++) {
+		packet = s->in_flight[i];
+		host->stream_in_flight -= (uint32_t)packet->dataLength;
+		if (--packet->referenceCount == 0)
+			enet_packet_destroy(packet);
+	}
+	net_stream_source_release(s->source);
+	free(s);
+	c->stream = NULL;
+	host->streams_len--;
+}
+
+static int
+net_enet_acquire(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&net_enet_lock);
+	if (net_enet_users == 0 && enet_initialize() != 0)
+		ret = -1;
+	else
+		net_enet_users++;
+	pthread_mutex_unlock(&net_enet_lock);
+	return ret;
+}
+
+static void
+net_enet_release(void)
+{
+	pthread_mutex_lock(&net_enet_lock);
+	if (--net_enet_users == 0)
+		enet_deinitialize();
+	pthread_mutex_unlock(&net_enet_lock);
+}
+
 struct host *
 net_host_create_listener(int address_type, uint16_t port, size_t maxClients,
                          size_t channels, uint32_t incoming_bandwidth,
@@ -58,12 +453,18 @@ net_host_create_listener(int address_type, uint16_t port, size_t maxClients,
 {
 	ENetAddress address;
 	struct host *host;
+	size_t i;
+
+	if (maxClients == 0 || maxClients > CLIENT_SLOTS_MAX)
+		return NULL;
 
-	if (maxClients == 0)
+	if (net_enet_acquire() != 0)
 		return NULL;
 
-	if (!(host = malloc(sizeof(*host))))
+	if (!(host = malloc(sizeof(*host)))) {
+		net_enet_release();
 		return NULL;
+	}
 	memset(host, 0, sizeof(*host));
 
 	host->connect_callback = NULL;
@@ -72,12 +473,25 @@ net_host_create_listener(int address_type, uint16_t port, size_t maxClients,
 
 	if (!(host->clients = malloc(sizeof(*host->clients) * maxClients))) {
 		free(host);
+		net_enet_release();
 		return NULL;
 	}
 	memset(host->clients, 0, sizeof(*host->clients) * maxClients);
 	host->clients_len = maxClients;
 
-	host->next_client_id = 1;
+	for (i = 0; i < maxClients; i++)
+		host->clients[i].next_free = i + 1;
+	host->free_client = 0;
+
+	atomic_init(&host->stop, false);
+	pthread_mutex_init(&host->stats_lock, NULL);
+	net_host_init_counters(&host->counters);
+	// Without the eventfd polling just can't be woken up early
+	host->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	atomic_init(&host->wake_pending, false);
+
+	host->stream_peer_window = NET_STREAM_DEFAULT_PEER_WINDOW;
+	host->stream_host_window = NET_STREAM_DEFAULT_HOST_WINDOW;
 
 	enet_address_build_loopback(&address, address_type);
 	address.port = port;
@@ -88,6 +502,10 @@ net_host_create_listener(int address_type, uint16_t port, size_t maxClients,
 	                              outgoing_bandwidth);
 	if (!host->host)
 	{
+		net_enet_release();
+		pthread_mutex_destroy(&host->stats_lock);
+		if (host->wake_fd >= 0)
+			close(host->wake_fd);
 		free(host->clients);
 		free(host);
 		return NULL;
@@ -102,11 +520,40 @@ net_host_create_listener(int address_type, uint16_t port, size_t maxClients,
 void
 net_host_destroy(struct host *host)
 {
+	struct net_message m;
+	size_t i;
+
 	if (!host)
 		return;
+	net_host_stop_thread(host);
+	net_host_unregister(host);
+	net_host_release_receives(host);
+	for (i = 0; i < host->clients_len; i++)
+		net_host_end_stream(host, &host->clients[i]);
+	if (host->incoming.slots) {
+		while (spsc_ring_pop(&host->incoming, &m)) {
+			if (m.packet)
+				enet_packet_destroy(m.packet);
+		}
+	}
+	// Last chance for packets queued in ENet, such as disconnect messages
+	enet_host_flush(host->host);
 	enet_host_destroy(host->host);
+	spsc_ring_deinit(&host->incoming);
+	spsc_ring_deinit(&host->outgoing);
+	free(host->connected);
+	free(host->stats);
+	free(host->buckets);
+	pthread_mutex_destroy(&host->stats_lock);
+	if (host->wake_fd >= 0)
+		close(host->wake_fd);
+	free(host->recvs.descs);
+	free(host->recvs.events);
+	free(host->sends.descs);
+	free(host->sends.data);
 	free(host->clients);
 	free(host);
+	net_enet_release();
 }
 
 void
@@ -132,179 +579,1552 @@ net_host_set_disconnect_callback(struct host *host, disconnect_callback callback
 	host->disconnect_callback = callback;
 }
 
+void
+net_host_set_stream_callback(struct host *host, stream_callback callback)
+{
+	if (!host)
+		return;
+	host->stream_callback = callback;
+}
 
-static int
-net_host_handle_connect(struct host *host, ENetEvent *ev)
+static inline bool
+net_host_recv_queue_full(struct host *host)
 {
-	struct client *c;
-	size_t i;
+	struct recv_queue *q = &host->recvs;
 
-	if (!host || !ev)
-		return -1;
+	return q->descs_len >= q->descs_capacity
+	       || q->events_len >= q->events_capacity;
+}
 
-	for (i = 0; i < host->clients_len; i++) {
-		c = &host->clients[i];
-		if (c->id != 0)
-			continue;
+static int
+net_host_queue_event(struct host *host, uint32_t type, uint32_t client,
+                     uint32_t data)
+{
+	struct recv_queue *q = &host->recvs;
+	struct net_event *e;
+
+	e = &q->events[q->events_len++];
+	e->type = type;
+	e->client = client;
+	e->data = data;
+	e->receives_before = q->descs_len;
+	return CALLBACK_RESULT_CONTINUE;
+}
 
-		// Free client slot
-		c->id = host->next_client_id++;
-		c->peer = ev->peer;
-		c->peer->data = (void *)(uintptr_t)c->id;
+/*
+ * Hands events to the game, either through the receive queue or the
+ * callbacks. These run on the game thread.
+ */
 
-		if (!host->connect_callback)
-			return CALLBACK_RESULT_CONTINUE;
+static int
+net_host_dispatch_connect(struct host *host, uint32_t client, uint32_t data)
+{
+	if (host->recvs.descs)
+		return net_host_queue_event(host, NET_EVENT_CONNECT, client, data);
 
-		return host->connect_callback(c->id, ev->data);
-	}
+	if (!host->connect_callback)
+		return CALLBACK_RESULT_CONTINUE;
 
-	return -1;
+	return host->connect_callback(client, data);
 }
 
 static int
-net_host_handle_receive(struct host *host, ENetEvent *ev)
+net_host_dispatch_receive(struct host *host, uint32_t client, ENetPacket *packet)
 {
-	uint32_t client_id;
+	struct net_packet_counters *counters;
+	struct recv_desc *d;
+	uint64_t start;
 	int ret;
 
-	if (!host || !ev)
-		return -1;
+	counters = net_host_packet_counters(host, packet->data, packet->dataLength);
 
-	if (ev->packet->dataLength > INT_MAX)
+	if (packet->dataLength > INT_MAX) {
+		net_counter_add(&counters->drops, 1);
+		enet_packet_destroy(packet);
 		return -1;
+	}
+
+	if (host->recvs.descs) {
+		d = &host->recvs.descs[host->recvs.descs_len++];
+		d->client = client;
+		d->len = (uint32_t)packet->dataLength;
+		d->data = packet->data;
+		d->packet = packet;
+		return CALLBACK_RESULT_CONTINUE;
+	}
 
 	if (!host->receive_callback)
 	{
-		enet_packet_destroy(ev->packet);
+		enet_packet_destroy(packet);
 		return CALLBACK_RESULT_CONTINUE;
 	}
 
-	client_id = (uint32_t)(uintptr_t)ev->peer->data;
-
-	ret = host->receive_callback(client_id, ev->packet->data,
-	                             (uint32_t)ev->packet->dataLength);
+	start = net_now_ns();
+	ret = host->receive_callback(client, packet->data,
+	                             (uint32_t)packet->dataLength);
+	net_counter_add(&counters->callback_ns, net_now_ns() - start);
 
-	enet_packet_destroy(ev->packet);
+	enet_packet_destroy(packet);
 
 	return ret;
 }
 
 static int
-net_host_handle_disconnect(struct host *host, ENetEvent *ev, uint32_t type)
+net_host_dispatch_disconnect(struct host *host, uint32_t client, uint32_t type)
 {
-	struct client *c;
-	uint32_t client_id;
-	size_t i;
-	int ret;
+	if (host->recvs.descs)
+		return net_host_queue_event(host, NET_EVENT_DISCONNECT, client, type);
 
-	if (!host || !ev)
-		return -1;
+	if (!host->disconnect_callback)
+		return CALLBACK_RESULT_CONTINUE;
 
-	client_id = (uint32_t)(uintptr_t)ev->peer->data;
+	return host->disconnect_callback(client, type);
+}
 
-	for (i = 0; i < host->clients_len; i++) {
-		c = &host->clients[i];
-		if (c->id != client_id)
-			continue;
+static int
+net_host_dispatch_stream(struct host *host, uint32_t type, uint32_t client,
+                         uint32_t bytes)
+{
+	if (host->recvs.descs)
+		return net_host_queue_event(host, type, client, bytes);
 
-		if (!host->disconnect_callback)
-			ret = CALLBACK_RESULT_CONTINUE;
-		else
-			ret = host->disconnect_callback(client_id, type);
+	if (!host->stream_callback)
+		return CALLBACK_RESULT_CONTINUE;
 
-		memset(c, 0, sizeof(*c));
-		c->id = 0;
-		c->peer = NULL;
+	return host->stream_callback(client, type, bytes);
+}
 
-		return ret;
+/* Passes an event on to the game thread, or dispatches it right away */
+static int
+net_host_forward(struct host *host, uint32_t type, uint32_t client,
+                 uint32_t data, ENetPacket *packet)
+{
+	struct net_message m;
+
+	if (!host->threaded) {
+		switch (type) {
+		case NET_MSG_CONNECT:
+			return net_host_dispatch_connect(host, client, data);
+		case NET_MSG_RECEIVE:
+			return net_host_dispatch_receive(host, client, packet);
+		case NET_MSG_DISCONNECT:
+			return net_host_dispatch_disconnect(host, client, data);
+		case NET_MSG_STREAM_PROGRESS:
+			return net_host_dispatch_stream(host, NET_EVENT_STREAM_PROGRESS,
+			                                client, data);
+		case NET_MSG_STREAM_COMPLETE:
+			return net_host_dispatch_stream(host, NET_EVENT_STREAM_COMPLETE,
+			                                client, data);
+		default:
+			return -1;
+		}
 	}
 
-	return -1;
+	m.type = type;
+	m.client = client;
+	m.data = data;
+	m.packet = packet;
+	m.source = NULL;
+	// net_host_can_accept made sure there is room
+	spsc_ring_push(&host->incoming, &m);
+	return CALLBACK_RESULT_CONTINUE;
 }
 
-int
-net_host_poll_events(struct host *host, uint32_t service_timeout_ms)
+/*
+ * The handlers below run on the thread servicing ENet and keep track of the
+ * client slots.
+ */
+
+static void
+net_bucket_fill(struct token_bucket *b, const struct packet_limit *l, uint32_t now)
 {
-	ENetEvent ev;
-	int ret;
+	b->tokens = l->burst * 1000;
+	b->last_ms = now;
+}
 
-	if (!host)
-		return -1;
+/* Takes a packet worth of tokens if there is one */
+static bool
+net_bucket_take(struct token_bucket *b, const struct packet_limit *l, uint32_t now)
+{
+	uint64_t tokens;
 
-	ret = enet_host_service(host->host, &ev, service_timeout_ms);
+	if (l->rate == 0)
+		return true;
 
-	do
-	{
-		switch (ev.type)
-		{
-		case ENET_EVENT_TYPE_CONNECT:
-			ret = net_host_handle_connect(host, &ev);
-			break;
-		case ENET_EVENT_TYPE_RECEIVE:
-			ret = net_host_handle_receive(host, &ev);
-			break;
-		case ENET_EVENT_TYPE_DISCONNECT:
-			ret = net_host_handle_disconnect(host, &ev,
-			                DISCONNECT_TYPE_NORMAL);
-			break;
-		case ENET_EVENT_TYPE_DISCONNECT_TIMEOUT:
-			ret = net_host_handle_disconnect(host, &ev,
-			                DISCONNECT_TYPE_TIMEOUT);
-			break;
-		default:
-			break;
-		}
+	tokens = b->tokens + (uint64_t)(now - b->last_ms) * l->rate;
+	if (tokens > (uint64_t)l->burst * 1000)
+		tokens = (uint64_t)l->burst * 1000;
+	b->last_ms = now;
 
-		if (ret < -1)
-			return -1;
-		if (ret == CALLBACK_RESULT_STOP)
-			return 1;
-	} while ((ret = enet_host_check_events(host->host, &ev)) > 0);
+	if (tokens < 1000) {
+		b->tokens = (uint32_t)tokens;
+		return false;
+	}
+	b->tokens = (uint32_t)(tokens - 1000);
+	return true;
+}
 
-	return ret;
+/* Gives back a token taken by net_bucket_take */
+static void
+net_bucket_refund(struct token_bucket *b, const struct packet_limit *l)
+{
+	if (l->rate == 0)
+		return;
+	if ((uint64_t)b->tokens + 1000 > (uint64_t)l->burst * 1000)
+		b->tokens = l->burst * 1000;
+	else
+		b->tokens += 1000;
 }
 
-int
-net_host_send_packet(struct host *host, uint32_t client,
-                     int flags, uint8_t *buffer, int buffer_len)
+/* A new client starts with full buckets */
+static void
+net_host_reset_limits(struct host *host, size_t slot)
 {
-	ENetPacket *packet;
-	ENetPeer *peer;
-	uint32_t enet_flags;
+	struct client *c = &host->clients[slot];
+	struct token_bucket *buckets;
+	uint32_t now = enet_time_get();
 	size_t i;
 
-	if (!host)
+	net_bucket_fill(&c->bucket, &host->peer_limit, now);
+	c->violations = 0;
+	c->violations_start_ms = now;
+	c->kicked = false;
+
+	if (!host->buckets)
+		return;
+	buckets = &host->buckets[slot * NET_PACKET_IDS];
+	for (i = 0; i < NET_PACKET_IDS; i++)
+		net_bucket_fill(&buckets[i], &host->limits[i], now);
+}
+
+/*
+ * Whether a received packet is within the limits. Clients that break them
+ * too often are disconnected and everything else they send is dropped.
+ */
+static bool
+net_host_admit(struct host *host, struct client *c, const ENetPacket *packet)
+{
+	const struct packet_limit *limit;
+	struct token_bucket *bucket;
+	uint8_t id;
+	uint32_t now;
+
+	if (c->kicked)
+		return false;
+
+	id = packet->dataLength > 0 ? packet->data[0] : 0;
+	limit = &host->limits[id];
+	now = enet_time_get();
+
+	bucket = host->buckets
+	         ? &host->buckets[(size_t)(c - host->clients) * NET_PACKET_IDS + id]
+	         : NULL;
+	if ((limit->max_size == 0 || packet->dataLength <= limit->max_size)
+	    && (!bucket || net_bucket_take(bucket, limit, now))) {
+		if (net_bucket_take(&c->bucket, &host->peer_limit, now))
+			return true;
+		// The packet is dropped, so it must not use up the id's budget
+		if (bucket)
+			net_bucket_refund(bucket, limit);
+	}
+
+	if (now - c->violations_start_ms > host->violation_window_ms) {
+		c->violations = 0;
+		c->violations_start_ms = now;
+	}
+	if (host->violation_limit > 0 && ++c->violations >= host->violation_limit) {
+		c->kicked = true;
+		// The disconnect event frees the slot as usual
+		enet_peer_disconnect(c->peer, DISCONNECT_REASON_KICKED);
+	}
+	return false;
+}
+
+int
+net_host_set_packet_limit(struct host *host, uint8_t id, uint32_t rate,
+                          uint32_t burst, uint32_t max_size)
+{
+	if (!host || host->threaded || (rate > 0 && burst == 0)
+	    || burst > UINT32_MAX / 1000)
 		return -1;
-	if (client == 0)
+
+	if (rate > 0 && !host->buckets
+	    && !(host->buckets = calloc(host->clients_len * NET_PACKET_IDS,
+	                                sizeof(*host->buckets))))
 		return -1;
 
-	peer = NULL;
-	for (i = 0; i < host->clients_len; i++) {
-		if (host->clients[i].id == client) {
-			peer = host->clients[i].peer;
+	host->limits[id].rate = rate;
+	host->limits[id].burst = burst;
+	host->limits[id].max_size = max_size;
+	return 0;
+}
+
+int
+net_host_set_peer_limit(struct host *host, uint32_t rate, uint32_t burst)
+{
+	if (!host || host->threaded || (rate > 0 && burst == 0)
+	    || burst > UINT32_MAX / 1000)
+		return -1;
+	host->peer_limit.rate = rate;
+	host->peer_limit.burst = burst;
+	return 0;
+}
+
+int
+net_host_set_violation_limit(struct host *host, uint32_t violations,
+                             uint32_t window_ms)
+{
+	if (!host || host->threaded)
+		return -1;
+	host->violation_limit = violations;
+	host->violation_window_ms = window_ms;
+	return 0;
+}
+
+static int
+net_host_handle_connect(struct host *host, ENetEvent *ev)
+{
+	struct client *c;
+	size_t slot;
+
+	if (!host || !ev)
+		return -1;
+
+	if (host->free_client >= host->clients_len)
+		return -1;
+
+	slot = host->free_client;
+	c = &host->clients[slot];
+	host->free_client = c->next_free;
+
+	c->id = client_id_make(slot, c->generation);
+	c->peer = ev->peer;
+	c->peer->data = (void *)(uintptr_t)c->id;
+	if (enet_address_get_host_ip(&c->peer->address, c->address,
+	                             sizeof(c->address)) != 0)
+		c->address[0] = '\0';
+	net_host_reset_limits(host, slot);
+
+	return net_host_forward(host, NET_MSG_CONNECT, c->id, ev->data, NULL);
+}
+
+static int
+net_host_handle_receive(struct host *host, ENetEvent *ev)
+{
+	struct net_packet_counters *counters;
+	struct client *c;
+	uint32_t client_id;
+
+	if (!host || !ev)
+		return -1;
+
+	client_id = (uint32_t)(uintptr_t)ev->peer->data;
+
+	counters = net_host_packet_counters(host, ev->packet->data,
+	                                    ev->packet->dataLength);
+	net_counter_add(&counters->packets_in, 1);
+	net_counter_add(&counters->bytes_in, ev->packet->dataLength);
+
+	if (!(c = net_host_find_client(host, client_id))
+	    || !net_host_admit(host, c, ev->packet)) {
+		net_counter_add(&counters->drops, 1);
+		enet_packet_destroy(ev->packet);
+		return CALLBACK_RESULT_CONTINUE;
+	}
+
+	return net_host_forward(host, NET_MSG_RECEIVE, client_id, 0, ev->packet);
+}
+
+static int
+net_host_handle_disconnect(struct host *host, ENetEvent *ev, uint32_t type)
+{
+	struct client *c;
+	uint32_t client_id;
+	int ret;
+
+	if (!host || !ev)
+		return -1;
+
+	client_id = (uint32_t)(uintptr_t)ev->peer->data;
+
+	if (!(c = net_host_find_client(host, client_id)))
+		return -1;
+
+	net_host_end_stream(host, c);
+	ret = net_host_forward(host, NET_MSG_DISCONNECT, client_id, type, NULL);
+
+	c->id = 0;
+	c->peer = NULL;
+	c->generation++;
+	c->next_free = host->free_client;
+	host->free_client = (size_t)(c - host->clients);
+
+	return ret;
+}
+
+/* Whether there is room to take another event out of ENet */
+static bool
+net_host_can_accept(struct host *host)
+{
+	if (host->threaded)
+		return spsc_ring_room(&host->incoming) > 0;
+	return !host->recvs.descs || !net_host_recv_queue_full(host);
+}
+
+/*
+ * How much a stream may have in flight to a client. With a rate this is
+ * what the client can take in over a round trip.
+ */
+static uint32_t
+net_host_stream_window(struct host *host, ENetPeer *peer)
+{
+	uint64_t rate, window;
+
+	// The client's advertised downstream bandwidth, zero when unlimited
+	rate = host->stream_rate ? host->stream_rate : peer->incomingBandwidth;
+	window = host->stream_peer_window;
+	if (rate > 0) {
+		window = rate * (peer->roundTripTime
+		                 + 2 * (uint64_t)peer->roundTripTimeVariance) / 1000;
+		if (window > host->stream_peer_window)
+			window = host->stream_peer_window;
+	}
+	if (peer->windowSize > 0 && window > peer->windowSize)
+		window = peer->windowSize;
+	return (uint32_t)window;
+}
+
+/* Drops the chunks the client has acknowledged */
+static void
+net_host_reap_stream(struct host *host, struct net_stream *s)
+{
+	ENetPacket *packet;
+	int i, j;
+
+	for (i = j = 0; i < s->in_flight_len; i++) {
+		packet = s->in_flight[i];
+		if (packet->referenceCount > 1) {
+			s->in_flight[j++] = packet;
+			continue;
+		}
+		s->in_flight_bytes -= (uint32_t)packet->dataLength;
+		host->stream_in_flight -= (uint32_t)packet->dataLength;
+		enet_packet_destroy(packet);
+	}
+	s->in_flight_len = j;
+}
+
+static void
+net_host_fill_stream(struct host *host, struct client *c)
+{
+	struct net_stream *s = c->stream;
+	struct net_packet_counters *counters;
+	ENetPacket *packet;
+	uint32_t window, in_transit, n;
+	uint8_t *chunk;
+
+	window = net_host_stream_window(host, c->peer);
+	while (s->cursor < s->source->len
+	       && s->in_flight_len < NET_STREAM_MAX_CHUNKS) {
+		n = s->source->len - s->cursor;
+		if (n > s->source->chunk_size)
+			n = s->source->chunk_size;
+
+		// Anything reliable counts against the window, not just the
+		// stream. One chunk is always allowed so a stream cannot stall.
+		in_transit = s->in_flight_bytes;
+		if (c->peer->reliableDataInTransit > in_transit)
+			in_transit = c->peer->reliableDataInTransit;
+		if (s->in_flight_len > 0
+		    && (in_transit + n + 1 > window
+		        || host->stream_in_flight + n + 1 > host->stream_host_window))
+			break;
+
+		// The packet borrows the framed chunk from the source instead
+		// of copying it, chunks before this one each took a byte for
+		// the packet id
+		chunk = s->source->data + s->cursor + s->cursor / s->source->chunk_size;
+		if (!(packet = enet_packet_create(chunk, n + 1,
+		                                  ENET_PACKET_FLAG_RELIABLE
+		                                  | ENET_PACKET_FLAG_NO_ALLOCATE)))
+			break;
+		atomic_fetch_add_explicit(&s->source->refs, 1, memory_order_relaxed);
+		packet->userData = s->source;
+		packet->freeCallback = net_stream_chunk_free;
+
+		packet->referenceCount++;
+		if (enet_peer_send(c->peer, 0, packet) != 0) {
+			if (--packet->referenceCount == 0)
+				enet_packet_destroy(packet);
+			break;
+		}
+
+		counters = &host->counters.packets[s->source->packet_id];
+		net_counter_add(&counters->packets_out, 1);
+		net_counter_add(&counters->bytes_out, n + 1);
+
+		s->in_flight[s->in_flight_len++] = packet;
+		s->in_flight_bytes += n + 1;
+		host->stream_in_flight += n + 1;
+		s->cursor += n;
+	}
+}
+
+/*
+ * Reports stream progress and hands ENet the next chunks. Runs on the
+ * thread servicing ENet, before it sends.
+ */
+static int
+net_host_pump_streams(struct host *host)
+{
+	struct client *c;
+	struct net_stream *s;
+	size_t i, slot;
+	uint32_t acked;
+	int ret;
+
+	if (host->streams_len == 0)
+		return CALLBACK_RESULT_CONTINUE;
+
+	ret = CALLBACK_RESULT_CONTINUE;
+	for (i = 0; i < host->clients_len && ret != CALLBACK_RESULT_STOP; i++) {
+		slot = (host->stream_next + i) % host->clients_len;
+		c = &host->clients[slot];
+		// After a reset ENet has dropped its references without the
+		// chunks being acknowledged
+		if (!(s = c->stream) || c->peer->state != ENET_PEER_STATE_CONNECTED)
+			continue;
+
+		net_host_reap_stream(host, s);
+		acked = s->cursor - (s->in_flight_bytes - (uint32_t)s->in_flight_len);
+
+		if (s->cursor == s->source->len && s->in_flight_len == 0) {
+			if (!net_host_can_accept(host))
+				continue;
+			net_host_end_stream(host, c);
+			ret = net_host_forward(host, NET_MSG_STREAM_COMPLETE, c->id,
+			                       acked, NULL);
+			continue;
+		}
+
+		if (acked != s->reported && net_host_can_accept(host)) {
+			s->reported = acked;
+			ret = net_host_forward(host, NET_MSG_STREAM_PROGRESS, c->id,
+			                       acked, NULL);
+			// The callback may have touched the streams
+			if (!c->stream)
+				continue;
+		}
+
+		net_host_fill_stream(host, c);
+	}
+
+	host->stream_next = (host->stream_next + 1) % host->clients_len;
+	return ret;
+}
+
+/* Handles ev and whatever else ENet has ready */
+static int
+net_host_handle_events(struct host *host, ENetEvent *ev)
+{
+	int ret;
+
+	do
+	{
+		switch (ev->type)
+		{
+		case ENET_EVENT_TYPE_CONNECT:
+			ret = net_host_handle_connect(host, ev);
+			break;
+		case ENET_EVENT_TYPE_RECEIVE:
+			ret = net_host_handle_receive(host, ev);
+			break;
+		case ENET_EVENT_TYPE_DISCONNECT:
+			ret = net_host_handle_disconnect(host, ev,
+			                DISCONNECT_TYPE_NORMAL);
+			break;
+		case ENET_EVENT_TYPE_DISCONNECT_TIMEOUT:
+			ret = net_host_handle_disconnect(host, ev,
+			                DISCONNECT_TYPE_TIMEOUT);
+			break;
+		default:
+			ret = CALLBACK_RESULT_CONTINUE;
+			break;
+		}
+
+		if (ret < -1)
+			return -1;
+		if (ret == CALLBACK_RESULT_STOP)
+			return 1;
+		if (!net_host_can_accept(host))
+			return 0;
+	} while ((ret = enet_host_check_events(host->host, ev)) > 0);
+
+	return ret;
+}
+
+void
+net_host_wake(struct host *host)
+{
+	uint64_t one = 1;
+	ssize_t ret;
+
+	if (!host || host->wake_fd < 0)
+		return;
+	if (atomic_exchange(&host->wake_pending, true))
+		return;
+	ret = write(host->wake_fd, &one, sizeof(one));
+	(void)ret;
+}
+
+/* Waits for a packet on the ENet socket or a call to net_host_wake */
+static void
+net_host_wait(struct host *host, uint32_t timeout_ms)
+{
+	struct pollfd fds[2];
+	uint64_t count;
+	ssize_t ret;
+
+	fds[0].fd = host->host->socket;
+	fds[0].events = POLLIN;
+	fds[1].fd = host->wake_fd;
+	fds[1].events = POLLIN;
+
+	if (poll(fds, 2, timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms) <= 0)
+		return;
+	if (fds[1].revents & POLLIN) {
+		// The caller looks for new work after this returns, so a wake
+		// coming in between the read and the store is not lost
+		ret = read(host->wake_fd, &count, sizeof(count));
+		(void)ret;
+		atomic_store(&host->wake_pending, false);
+	}
+}
+
+static int
+net_host_service(struct host *host, uint32_t service_timeout_ms)
+{
+	ENetEvent ev;
+	uint64_t start;
+	int ret;
+
+	if (net_host_pump_streams(host) == CALLBACK_RESULT_STOP)
+		return 1;
+
+	// Leave the events in ENet until there is room for them, but keep
+	// sending
+	if (!net_host_can_accept(host)) {
+		enet_host_flush(host->host);
+		return 0;
+	}
+
+	if (host->wake_fd < 0) {
+		ret = enet_host_service(host->host, &ev, service_timeout_ms);
+	} else {
+		// Do our own waiting so net_host_wake can interrupt it
+		ret = enet_host_service(host->host, &ev, 0);
+		if (ret == 0 && service_timeout_ms > 0) {
+			net_host_wait(host, service_timeout_ms);
+			ret = enet_host_service(host->host, &ev, 0);
+		}
+	}
+	if (ret <= 0)
+		return ret;
+
+	// Only the time spent on the events, not waiting for them
+	start = net_now_ns();
+	ret = net_host_handle_events(host, &ev);
+	net_histogram_add(host->counters.service_us, net_now_ns() - start);
+	return ret;
+}
+
+/* Dispatches the events the network thread has received so far */
+static int
+net_host_drain_incoming(struct host *host)
+{
+	struct net_message m;
+	size_t slot;
+	int ret;
+
+	while (!(host->recvs.descs && net_host_recv_queue_full(host))
+	       && spsc_ring_pop(&host->incoming, &m)) {
+		slot = client_id_slot(m.client);
+		switch (m.type) {
+		case NET_MSG_CONNECT:
+			host->connected[slot] = m.client;
+			ret = net_host_dispatch_connect(host, m.client, m.data);
+			break;
+		case NET_MSG_RECEIVE:
+			ret = net_host_dispatch_receive(host, m.client, m.packet);
+			break;
+		case NET_MSG_DISCONNECT:
+			host->connected[slot] = 0;
+			ret = net_host_dispatch_disconnect(host, m.client, m.data);
+			break;
+		case NET_MSG_STREAM_PROGRESS:
+			ret = net_host_dispatch_stream(host, NET_EVENT_STREAM_PROGRESS,
+			                               m.client, m.data);
+			break;
+		case NET_MSG_STREAM_COMPLETE:
+			ret = net_host_dispatch_stream(host, NET_EVENT_STREAM_COMPLETE,
+			                               m.client, m.data);
+			break;
+		default:
+			ret = CALLBACK_RESULT_CONTINUE;
 			break;
 		}
+
+		if (ret == CALLBACK_RESULT_STOP)
+			return 1;
+	}
+
+	return 0;
+}
+
+static void
+net_host_read_stats(struct client *c, struct peer_stats *out)
+{
+	ENetPeer *peer = c->peer;
+
+	out->client = c->id;
+	out->address_type = (uint32_t)peer->address.type;
+	out->port = peer->address.port;
+	out->round_trip_time = peer->roundTripTime;
+	out->round_trip_time_variance = peer->roundTripTimeVariance;
+	out->packet_loss = peer->packetLoss;
+	out->packet_loss_variance = peer->packetLossVariance;
+	out->packet_throttle = peer->packetThrottle;
+	out->incoming_bandwidth = peer->incomingBandwidth;
+	out->outgoing_bandwidth = peer->outgoingBandwidth;
+	out->reliable_in_transit = peer->reliableDataInTransit;
+	memcpy(out->address, c->address, sizeof(out->address));
+}
+
+/* Copies the stats of every slot for the game thread, on the network thread */
+static void
+net_host_publish_stats(struct host *host)
+{
+	size_t i;
+
+	pthread_mutex_lock(&host->stats_lock);
+	for (i = 0; i < host->clients_len; i++) {
+		if (host->clients[i].id == 0)
+			host->stats[i].client = 0;
+		else
+			net_host_read_stats(&host->clients[i], &host->stats[i]);
 	}
+	pthread_mutex_unlock(&host->stats_lock);
+}
+
+int
+net_host_poll_events(struct host *host, uint32_t service_timeout_ms)
+{
+	uint64_t start;
+	int ret;
 
-	if (!peer)
+	if (!host)
 		return -1;
 
+	start = net_now_ns();
+
+	// Also picks up what was left over when the network thread stopped
+	ret = 0;
+	if (host->incoming.slots)
+		ret = net_host_drain_incoming(host);
+
+	if (ret == 0 && !host->threaded) {
+		ret = net_host_service(host, service_timeout_ms);
+		// The network thread does this when there is one
+		if (host->registry)
+			net_host_publish_stats(host);
+	}
+
+	net_histogram_add(host->counters.poll_us, net_now_ns() - start);
+	return ret;
+}
+
+static int
+net_packet_flags(int flags, uint32_t *enet_flags)
+{
 	switch (flags) {
 	case PACKET_FLAG_RELIABLE:
-		enet_flags = ENET_PACKET_FLAG_RELIABLE;
-		break;
+		*enet_flags = ENET_PACKET_FLAG_RELIABLE;
+		return 0;
 	case PACKET_FLAG_UNSEQUENCED:
-		enet_flags = ENET_PACKET_FLAG_UNSEQUENCED;
-		break;
+		*enet_flags = ENET_PACKET_FLAG_UNSEQUENCED;
+		return 0;
 	default:
 		return -1;
 	}
+}
 
-	packet = enet_packet_create(buffer, buffer_len, enet_flags);
-	if (enet_peer_send(peer, 0, packet) != 0) {
-		enet_packet_destroy(packet);
-		return -1;
+/*
+ * Queues the packet to a peer, on the thread servicing ENet. The packet is
+ * freed if nothing holds a reference to it after a failure.
+ */
+static int
+net_host_deliver(struct host *host, uint32_t client, ENetPacket *packet)
+{
+	struct net_packet_counters *counters;
+	struct client *c;
+
+	counters = net_host_packet_counters(host, packet->data, packet->dataLength);
+	if ((c = net_host_find_client(host, client))
+	    && enet_peer_send(c->peer, 0, packet) == 0) {
+		net_counter_add(&counters->packets_out, 1);
+		net_counter_add(&counters->bytes_out, packet->dataLength);
+		return 0;
 	}
 
-	return 0;
+	net_counter_add(&counters->drops, 1);
+	if (packet->referenceCount == 0)
+		enet_packet_destroy(packet);
+	return -1;
+}
+
+static void
+net_host_release(ENetPacket *packet)
+{
+	if (--packet->referenceCount == 0)
+		enet_packet_destroy(packet);
+}
+
+/*
+ * Sends a packet from the game thread, directly or through the network
+ * thread. A packet that is not shared belongs to this call and is freed on
+ * failure. Shared packets are left to net_host_end_shared: earlier sends of
+ * the same packet may already be in flight on the network thread, so the
+ * game thread must not look at its reference count.
+ */
+static int
+net_host_submit(struct host *host, uint32_t client, ENetPacket *packet,
+                bool shared)
+{
+	struct net_message m;
+
+	if (!host->threaded)
+		return net_host_deliver(host, client, packet);
+
+	if (!net_host_knows_client(host, client))
+		goto fail;
+
+	m.type = NET_MSG_SEND;
+	m.client = client;
+	m.data = 0;
+	m.packet = packet;
+	m.source = NULL;
+	if (!spsc_ring_push(&host->outgoing, &m))
+		goto fail;
+	net_host_wake(host);
+	return 0;
+
+fail:
+	net_host_count_drops(host, packet->data, packet->dataLength, 1);
+	if (!shared)
+		enet_packet_destroy(packet);
+	return -1;
+}
+
+/*
+ * A packet sent to many clients is created once and shared by all of them.
+ * The game thread holds an extra reference while submitting so the packet
+ * cannot be freed half way through, even if some of the sends fail or ENet
+ * already sent it to the first peers. With a network thread there must be
+ * room for every send plus the release, so the release can never be lost.
+ */
+static ENetPacket *
+net_host_begin_shared(struct host *host, const uint8_t *buffer, size_t len,
+                      uint32_t enet_flags, size_t recipients)
+{
+	ENetPacket *packet;
+
+	if ((host->threaded && spsc_ring_room(&host->outgoing) < recipients + 1)
+	    || !(packet = enet_packet_create(buffer, len, enet_flags))) {
+		net_host_count_drops(host, buffer, len, recipients);
+		return NULL;
+	}
+	packet->referenceCount++;
+	return packet;
+}
+
+static void
+net_host_end_shared(struct host *host, ENetPacket *packet)
+{
+	struct net_message m;
+
+	if (!host->threaded) {
+		net_host_release(packet);
+		return;
+	}
+
+	m.type = NET_MSG_RELEASE;
+	m.client = 0;
+	m.data = 0;
+	m.packet = packet;
+	m.source = NULL;
+	spsc_ring_push(&host->outgoing, &m);
+	net_host_wake(host);
+}
+
+int
+net_host_send_packet(struct host *host, uint32_t client,
+                     int flags, uint8_t *buffer, int buffer_len)
+{
+	ENetPacket *packet;
+	uint32_t enet_flags;
+
+	if (!host || buffer_len < 0)
+		return -1;
+
+	if (!net_host_knows_client(host, client)) {
+		net_host_count_drops(host, buffer, (size_t)buffer_len, 1);
+		return -1;
+	}
+
+	if (net_packet_flags(flags, &enet_flags) != 0)
+		return -1;
+
+	if (!(packet = enet_packet_create(buffer, buffer_len, enet_flags)))
+		return -1;
+
+	return net_host_submit(host, client, packet, false);
+}
+
+int
+net_host_broadcast(struct host *host, int flags, uint8_t *buffer,
+                   int buffer_len, const uint32_t *clients, int n)
+{
+	ENetPacket *packet;
+	uint32_t enet_flags;
+	int i, sent;
+
+	if (!host || buffer_len < 0 || n < 0 || (n > 0 && !clients))
+		return -1;
+
+	if (net_packet_flags(flags, &enet_flags) != 0)
+		return -1;
+
+	if (!(packet = net_host_begin_shared(host, buffer, buffer_len,
+	                                     enet_flags, n)))
+		return -1;
+
+	sent = 0;
+	for (i = 0; i < n; i++) {
+		if (net_host_submit(host, clients[i], packet, true) == 0)
+			sent++;
+	}
+
+	net_host_end_shared(host, packet);
+	return sent;
+}
+
+int
+net_host_broadcast_except(struct host *host, int flags, uint8_t *buffer,
+                          int buffer_len, const uint32_t *except, int n)
+{
+	ENetPacket *packet;
+	uint32_t enet_flags, id;
+	size_t i;
+	int j, sent;
+
+	if (!host || buffer_len < 0 || n < 0 || (n > 0 && !except))
+		return -1;
+
+	if (net_packet_flags(flags, &enet_flags) != 0)
+		return -1;
+
+	if (!(packet = net_host_begin_shared(host, buffer, buffer_len,
+	                                     enet_flags, host->clients_len)))
+		return -1;
+
+	sent = 0;
+	for (i = 0; i < host->clients_len; i++) {
+		if ((id = net_host_client_at(host, i)) == 0)
+			continue;
+		for (j = 0; j < n; j++) {
+			if (except[j] == id)
+				break;
+		}
+		if (j < n)
+			continue;
+		if (net_host_submit(host, id, packet, true) == 0)
+			sent++;
+	}
+
+	net_host_end_shared(host, packet);
+	return sent;
+}
+
+int
+net_host_init_send_queue(struct host *host, uint32_t descs, uint32_t bytes)
+{
+	struct send_queue *q;
+	struct send_desc *d;
+	uint8_t *data;
+
+	if (!host || descs == 0 || bytes == 0)
+		return -1;
+
+	q = &host->sends;
+	// Resizing would lose the queued packets
+	if (q->descs_len != 0 || q->data_len != 0)
+		return -1;
+
+	if (!(d = malloc(sizeof(*d) * descs)))
+		return -1;
+	if (!(data = malloc(bytes))) {
+		free(d);
+		return -1;
+	}
+
+	free(q->descs);
+	free(q->data);
+	q->descs = d;
+	q->data = data;
+	q->descs_capacity = descs;
+	q->data_capacity = bytes;
+	return 0;
+}
+
+struct send_queue *
+net_host_get_send_queue(struct host *host)
+{
+	if (!host || !host->sends.descs)
+		return NULL;
+	return &host->sends;
+}
+
+int
+net_host_flush_sends(struct host *host)
+{
+	struct send_queue *q;
+	struct send_desc *d;
+	ENetPacket *packet;
+	uint32_t enet_flags, i, j, k, descs_len, data_len;
+	int sent;
+
+	if (!host)
+		return -1;
+
+	q = &host->sends;
+	descs_len = q->descs_len;
+	data_len = q->data_len;
+	if (descs_len > q->descs_capacity || data_len > q->data_capacity) {
+		q->descs_len = 0;
+		q->data_len = 0;
+		return -1;
+	}
+
+	sent = 0;
+	for (i = 0; i < descs_len; i = j) {
+		d = &q->descs[i];
+
+		// Consecutive descriptors for the same payload share one packet
+		for (j = i + 1; j < descs_len; j++) {
+			if (q->descs[j].offset != d->offset
+			    || q->descs[j].len != d->len
+			    || q->descs[j].flags != d->flags)
+				break;
+		}
+
+		if (d->offset > data_len || d->len > data_len - d->offset)
+			continue;
+		if (net_packet_flags(d->flags, &enet_flags) != 0)
+			continue;
+
+		if (!(packet = net_host_begin_shared(host, q->data + d->offset,
+		                                     d->len, enet_flags, j - i)))
+			continue;
+		for (k = i; k < j; k++) {
+			if (net_host_submit(host, q->descs[k].client, packet, true) == 0)
+				sent++;
+		}
+		net_host_end_shared(host, packet);
+	}
+
+	q->descs_len = 0;
+	q->data_len = 0;
+	return sent;
+}
+
+int
+net_host_init_recv_queue(struct host *host, uint32_t packets, uint32_t events)
+{
+	struct recv_queue *q;
+	struct recv_desc *d;
+	struct net_event *e;
+
+	if (!host || packets == 0 || events == 0)
+		return -1;
+
+	q = &host->recvs;
+	if (q->descs_len != 0 || q->events_len != 0)
+		return -1;
+
+	if (!(d = malloc(sizeof(*d) * packets)))
+		return -1;
+	if (!(e = malloc(sizeof(*e) * events))) {
+		free(d);
+		return -1;
+	}
+
+	free(q->descs);
+	free(q->events);
+	q->descs = d;
+	q->events = e;
+	q->descs_capacity = packets;
+	q->events_capacity = events;
+	return 0;
+}
+
+struct recv_queue *
+net_host_get_recv_queue(struct host *host)
+{
+	if (!host || !host->recvs.descs)
+		return NULL;
+	return &host->recvs;
+}
+
+void
+net_host_release_receives(struct host *host)
+{
+	struct recv_queue *q;
+	uint32_t i;
+
+	if (!host)
+		return;
+
+	q = &host->recvs;
+	for (i = 0; i < q->descs_len; i++)
+		enet_packet_destroy(q->descs[i].packet);
+	q->descs_len = 0;
+	q->events_len = 0;
+}
+
+/* Runs on the thread servicing ENet and takes over the source reference */
+static int
+net_host_begin_stream(struct host *host, uint32_t client,
+                      struct net_stream_source *source)
+{
+	struct client *c;
+	struct net_stream *s;
+
+	if (!(c = net_host_find_client(host, client)) || c->stream)
+		goto fail;
+	if (!(s = malloc(sizeof(*s))))
+		goto fail;
+	memset(s, 0, sizeof(*s));
+	s->source = source;
+	c->stream = s;
+	host->streams_len++;
+	return 0;
+
+fail:
+	net_stream_source_release(source);
+	return -1;
+}
+
+int
+net_host_stream(struct host *host, uint32_t client,
+                struct net_stream_source *source)
+{
+	struct net_message m;
+
+	if (!host || !source)
+		return -1;
+
+	if (!net_host_knows_client(host, client))
+		return -1;
+
+	// Packets queued before the stream have to reach the client first
+	if (host->sends.descs_len > 0 && net_host_flush_sends(host) < 0)
+		return -1;
+
+	net_stream_source_retain(source);
+	if (!host->threaded)
+		return net_host_begin_stream(host, client, source);
+
+	m.type = NET_MSG_STREAM;
+	m.client = client;
+	m.data = 0;
+	m.packet = NULL;
+	m.source = source;
+	if (!spsc_ring_push(&host->outgoing, &m)) {
+		net_stream_source_release(source);
+		return -1;
+	}
+	net_host_wake(host);
+	return 0;
+}
+
+int
+net_host_set_stream_limits(struct host *host, uint32_t rate,
+                           uint32_t peer_window, uint32_t host_window)
+{
+	if (!host || host->threaded || peer_window == 0 || host_window == 0)
+		return -1;
+	host->stream_rate = rate;
+	host->stream_peer_window = peer_window;
+	host->stream_host_window = host_window;
+	return 0;
+}
+
+void
+net_host_get_counters(struct host *host, struct net_counters *out)
+{
+	struct net_packet_counters *c;
+	struct packet_counters *p;
+	size_t i;
+
+	if (!host || !out)
+		return;
+
+	for (i = 0; i < NET_PACKET_IDS; i++) {
+		c = &host->counters.packets[i];
+		p = &out->packets[i];
+		p->packets_in = atomic_load_explicit(&c->packets_in, memory_order_relaxed);
+		p->bytes_in = atomic_load_explicit(&c->bytes_in, memory_order_relaxed);
+		p->packets_out = atomic_load_explicit(&c->packets_out, memory_order_relaxed);
+		p->bytes_out = atomic_load_explicit(&c->bytes_out, memory_order_relaxed);
+		p->drops = atomic_load_explicit(&c->drops, memory_order_relaxed);
+		p->callback_ns = atomic_load_explicit(&c->callback_ns, memory_order_relaxed);
+	}
+	for (i = 0; i < NET_HISTOGRAM_BUCKETS; i++) {
+		out->poll_us[i] = atomic_load_explicit(&host->counters.poll_us[i],
+		                                       memory_order_relaxed);
+		out->service_us[i] = atomic_load_explicit(&host->counters.service_us[i],
+		                                          memory_order_relaxed);
+	}
+}
+
+int
+net_host_get_peer_stats(struct host *host, uint32_t client, struct peer_stats *out)
+{
+	struct client *c;
+	size_t slot;
+	int ret;
+
+	if (!host || !out)
+		return -1;
+
+	if (!host->threaded) {
+		if (!(c = net_host_find_client(host, client)))
+			return -1;
+		net_host_read_stats(c, out);
+		return 0;
+	}
+
+	slot = client_id_slot(client);
+	if (slot >= host->clients_len)
+		return -1;
+
+	ret = -1;
+	pthread_mutex_lock(&host->stats_lock);
+	if (host->stats[slot].client == client) {
+		*out = host->stats[slot];
+		ret = 0;
+	}
+	pthread_mutex_unlock(&host->stats_lock);
+	return ret;
+}
+
+int
+net_host_get_all_stats(struct host *host, struct peer_stats *out, int n)
+{
+	size_t i;
+	int count;
+
+	if (!host || n < 0 || (n > 0 && !out))
+		return -1;
+
+	count = 0;
+	if (!host->threaded) {
+		for (i = 0; i < host->clients_len && count < n; i++) {
+			if (host->clients[i].id != 0)
+				net_host_read_stats(&host->clients[i], &out[count++]);
+		}
+		return count;
+	}
+
+	pthread_mutex_lock(&host->stats_lock);
+	for (i = 0; i < host->clients_len && count < n; i++) {
+		if (host->stats[i].client != 0)
+			out[count++] = host->stats[i];
+	}
+	pthread_mutex_unlock(&host->stats_lock);
+	return count;
+}
+
+/* Sends what the game thread has submitted, on the network thread */
+static void
+net_host_drain_outgoing(struct host *host)
+{
+	struct net_message m;
+
+	while (spsc_ring_pop(&host->outgoing, &m)) {
+		switch (m.type) {
+		case NET_MSG_SEND:
+			net_host_deliver(host, m.client, m.packet);
+			break;
+		case NET_MSG_RELEASE:
+			net_host_release(m.packet);
+			break;
+		case NET_MSG_STREAM:
+			net_host_begin_stream(host, m.client, m.source);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static void *
+net_host_thread_main(void *arg)
+{
+	struct host *host = arg;
+	struct timespec backoff = { 0, 1000000 };
+
+	while (!atomic_load_explicit(&host->stop, memory_order_acquire)) {
+		net_host_drain_outgoing(host);
+
+		// The game thread is behind, give it a moment to catch up
+		// instead of spinning
+		if (!net_host_can_accept(host)) {
+			// Still keeps streams going and flushes
+			net_host_service(host, 0);
+			net_host_publish_stats(host);
+			nanosleep(&backoff, NULL);
+			continue;
+		}
+
+		net_host_service(host, host->service_timeout_ms);
+		net_host_publish_stats(host);
+	}
+
+	net_host_drain_outgoing(host);
+	enet_host_flush(host->host);
+	return NULL;
+}
+
+int
+net_host_start_thread(struct host *host, uint32_t service_timeout_ms,
+                      uint32_t queue_size)
+{
+	size_t i;
+
+	if (!host || host->threaded || queue_size == 0)
+		return -1;
+	// Events left from an earlier thread have to be dispatched first
+	if (host->incoming.slots && !spsc_ring_empty(&host->incoming))
+		return -1;
+
+	if (!host->connected
+	    && !(host->connected = malloc(sizeof(*host->connected) * host->clients_len)))
+		return -1;
+	for (i = 0; i < host->clients_len; i++)
+		host->connected[i] = host->clients[i].id;
+
+	if (!host->stats
+	    && !(host->stats = malloc(sizeof(*host->stats) * host->clients_len)))
+		return -1;
+	net_host_publish_stats(host);
+
+	if (!host->incoming.slots
+	    && spsc_ring_init(&host->incoming, sizeof(struct net_message),
+	                      queue_size) != 0)
+		return -1;
+	if (!host->outgoing.slots
+	    && spsc_ring_init(&host->outgoing, sizeof(struct net_message),
+	                      queue_size) != 0)
+		return -1;
+
+	host->service_timeout_ms = service_timeout_ms;
+	atomic_store(&host->stop, false);
+	host->threaded = true;
+	if (pthread_create(&host->thread, NULL, net_host_thread_main, host) != 0) {
+		host->threaded = false;
+		return -1;
+	}
+	return 0;
+}
+
+void
+net_host_stop_thread(struct host *host)
+{
+	if (!host || !host->threaded)
+		return;
+
+	atomic_store_explicit(&host->stop, true, memory_order_release);
+	// Don't wait for the service timeout
+	net_host_wake(host);
+	pthread_join(host->thread, NULL);
+	// Events still in incoming are dispatched by the next poll
+	host->threaded = false;
+}
+
+struct net_registry *
+net_registry_create(void)
+{
+	struct net_registry *r;
+
+	if (!(r = malloc(sizeof(*r))))
+		return NULL;
+	memset(r, 0, sizeof(*r));
+	pthread_mutex_init(&r->lock, NULL);
+	return r;
+}
+
+void
+net_registry_destroy(struct net_registry *r)
+{
+	if (!r)
+		return;
+	pthread_mutex_destroy(&r->lock);
+	free(r->hosts);
+	free(r);
+}
+
+int
+net_host_register(struct host *host, struct net_registry *r, uint32_t id)
+{
+	struct host **hosts;
+	size_t capacity;
+
+	if (!host || !r || host->threaded || host->registry)
+		return -1;
+
+	if (!host->stats
+	    && !(host->stats = malloc(sizeof(*host->stats) * host->clients_len)))
+		return -1;
+	net_host_publish_stats(host);
+
+	pthread_mutex_lock(&r->lock);
+	if (r->hosts_len == r->hosts_capacity) {
+		capacity = r->hosts_capacity ? r->hosts_capacity * 2 : 4;
+		if (!(hosts = realloc(r->hosts, sizeof(*hosts) * capacity))) {
+			pthread_mutex_unlock(&r->lock);
+			return -1;
+		}
+		r->hosts = hosts;
+		r->hosts_capacity = capacity;
+	}
+	r->hosts[r->hosts_len++] = host;
+	host->registry = r;
+	host->registry_id = id;
+	pthread_mutex_unlock(&r->lock);
+	return 0;
+}
+
+void
+net_host_unregister(struct host *host)
+{
+	struct net_registry *r;
+	size_t i;
+
+	if (!host || !(r = host->registry))
+		return;
+
+	pthread_mutex_lock(&r->lock);
+	for (i = 0; i < r->hosts_len; i++) {
+		if (r->hosts[i] == host) {
+			r->hosts[i] = r->hosts[--r->hosts_len];
+			break;
+		}
+	}
+	host->registry = NULL;
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void
+net_host_summarize(struct host *host, struct host_summary *out)
+{
+	struct net_packet_counters *c;
+	size_t i;
+
+	memset(out, 0, sizeof(*out));
+	out->id = host->registry_id;
+	out->port = host->host->address.port;
+	out->max_clients = (uint32_t)host->clients_len;
+
+	pthread_mutex_lock(&host->stats_lock);
+	for (i = 0; i < host->clients_len; i++) {
+		if (host->stats[i].client != 0)
+			out->clients++;
+	}
+	pthread_mutex_unlock(&host->stats_lock);
+
+	for (i = 0; i < NET_PACKET_IDS; i++) {
+		c = &host->counters.packets[i];
+		out->packets_in += atomic_load_explicit(&c->packets_in, memory_order_relaxed);
+		out->bytes_in += atomic_load_explicit(&c->bytes_in, memory_order_relaxed);
+		out->packets_out += atomic_load_explicit(&c->packets_out, memory_order_relaxed);
+		out->bytes_out += atomic_load_explicit(&c->bytes_out, memory_order_relaxed);
+		out->drops += atomic_load_explicit(&c->drops, memory_order_relaxed);
+	}
+}
+
+int
+net_registry_get_hosts(struct net_registry *r, struct host_summary *out, int n)
+{
+	int count;
+
+	if (!r || n < 0 || (n > 0 && !out))
+		return -1;
+
+	pthread_mutex_lock(&r->lock);
+	for (count = 0; (size_t)count < r->hosts_len && count < n; count++)
+		net_host_summarize(r->hosts[count], &out[count]);
+	pthread_mutex_unlock(&r->lock);
+	return count;
+}
+
+int
+net_registry_get_all_stats(struct net_registry *r, struct peer_stats *out,
+                           uint32_t *hosts, int n)
+{
+	struct host *host;
+	size_t i, j;
+	int count;
+
+	if (!r || n < 0 || (n > 0 && !out))
+		return -1;
+
+	count = 0;
+	pthread_mutex_lock(&r->lock);
+	for (i = 0; i < r->hosts_len && count < n; i++) {
+		host = r->hosts[i];
+		pthread_mutex_lock(&host->stats_lock);
+		for (j = 0; j < host->clients_len && count < n; j++) {
+			if (host->stats[j].client == 0)
+				continue;
+			if (hosts)
+				hosts[count] = host->registry_id;
+			out[count++] = host->stats[j];
+		}
+		pthread_mutex_unlock(&host->stats_lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return count;
+}
+
+void
+net_registry_stop_threads(struct net_registry *r)
+{
+	size_t i;
+
+	if (!r)
+		return;
+
+	// Every thread is told to stop before joining any so they wind down
+	// together instead of one service timeout after another
+	pthread_mutex_lock(&r->lock);
+	for (i = 0; i < r->hosts_len; i++) {
+		if (r->hosts[i]->threaded) {
+			atomic_store_explicit(&r->hosts[i]->stop, true, memory_order_release);
+			net_host_wake(r->hosts[i]);
+		}
+	}
+	for (i = 0; i < r->hosts_len; i++)
+		net_host_stop_thread(r->hosts[i]);
+	pthread_mutex_unlock(&r->lock);
 }
@@ -38,6 +38,13 @@ enum
 	DISCONNECT_TYPE_TIMEOUT = 1
 };
 
+/* Sent to the client as the disconnect data, see DisconnectReason */
+enum
+{
+	DISCONNECT_REASON_UNDEFINED = 0,
+	DISCONNECT_REASON_KICKED = 10
+};
+
 enum callback_result
 {
 	CALLBACK_RESULT_CONTINUE = 0,
@@ -47,9 +54,111 @@ enum callback_result
 typedef enum callback_result (*connect_callback)(uint32_t, uint32_t); /* client, ev->data */
 typedef enum callback_result (*receive_callback)(uint32_t, uint8_t *, int32_t); /* client, buffer, length */
 typedef enum callback_result (*disconnect_callback)(uint32_t, uint32_t); /* client, disconnect type */
+typedef enum callback_result (*stream_callback)(uint32_t, uint32_t, uint32_t); /* client, event type, bytes */
 
 struct host;
 
+/*
+ * Packets waiting to be sent by net_host_flush_sends. Callers append the
+ * payload to data and a descriptor pointing at it to descs, then bump the
+ * lengths. Consecutive descriptors with the same payload and flags share a
+ * single packet.
+ */
+struct send_desc
+{
+	uint32_t client;
+	int32_t flags;
+	uint32_t offset; /* into send_queue.data */
+	uint32_t len;
+};
+
+struct send_queue
+{
+	struct send_desc *descs;
+	uint8_t *data;
+	uint32_t descs_capacity;
+	uint32_t data_capacity;
+	uint32_t descs_len;
+	uint32_t data_len;
+};
+
+enum
+{
+	NET_EVENT_CONNECT = 0,
+	NET_EVENT_DISCONNECT = 1,
+	NET_EVENT_STREAM_PROGRESS = 2,
+	NET_EVENT_STREAM_COMPLETE = 3
+};
+
+/*
+ * With a receive queue net_host_poll_events stores packets and events here
+ * instead of calling the callbacks. The packet data is owned by ENet and
+ * stays valid until net_host_release_receives.
+ */
+struct recv_desc
+{
+	uint32_t client;
+	uint32_t len;
+	uint8_t *data;
+	void *packet;
+};
+
+struct net_event
+{
+	uint32_t type;
+	uint32_t client;
+	/*
+	 * ev->data for connects, disconnect type for disconnects, acknowledged
+	 * bytes for stream progress and the stream length for completions
+	 */
+	uint32_t data;
+	uint32_t receives_before; /* packets queued before this event */
+};
+
+struct recv_queue
+{
+	struct recv_desc *descs;
+	struct net_event *events;
+	uint32_t descs_capacity;
+	uint32_t events_capacity;
+	uint32_t descs_len;
+	uint32_t events_len;
+};
+
+/*
+ * Token bucket for received packets: rate packets per second up to burst
+ * at once. A rate of zero means no limit, as does a max_size of zero.
+ */
+struct packet_limit
+{
+	uint32_t rate;
+	uint32_t burst;
+	uint32_t max_size;
+};
+
+#define PEER_ADDRESS_LEN 48
+
+/*
+ * ENet's view of a connection. Packet loss is a fraction of 65536 and the
+ * throttle a fraction of 32 (unreliable packets sent). Bandwidths are what
+ * the client advertised in bytes per second, zero for unlimited.
+ */
+struct peer_stats
+{
+	uint32_t client;
+	uint32_t address_type;
+	uint32_t port;
+	uint32_t round_trip_time; /* ms, smoothed */
+	uint32_t round_trip_time_variance;
+	uint32_t packet_loss;
+	uint32_t packet_loss_variance;
+	uint32_t packet_throttle;
+	uint32_t incoming_bandwidth;
+	uint32_t outgoing_bandwidth;
+	uint32_t reliable_in_transit; /* bytes sent and not acknowledged */
+	char address[PEER_ADDRESS_LEN]; /* NUL terminated */
+};
+
 struct host *net_host_create_listener(int address_type,
                                       uint16_t port,
                                       size_t maxClients,
@@ -61,6 +170,192 @@ void net_host_destroy(struct host *);
 void net_host_set_connect_callback(struct host *, connect_callback);
 void net_host_set_receive_callback(struct host *, receive_callback);
 void net_host_set_disconnect_callback(struct host *, disconnect_callback);
+void net_host_set_stream_callback(struct host *, stream_callback);
 
 int net_host_poll_events(struct host *, uint32_t service_timeout_ms);
+/*
+ * Makes a net_host_poll_events (or the network thread) waiting for packets
+ * return right away, or the next one if none is waiting. Safe to call from
+ * any thread. Sends from the game thread wake the network thread on their
+ * own.
+ */
+void net_host_wake(struct host *);
 int net_host_send_packet(struct host *, uint32_t client, int flags, uint8_t *buffer, int buffer_len);
+
+/*
+ * Sends the same packet to many clients. The buffer is copied once into a
+ * single packet shared by every recipient. Returns the number of clients the
+ * packet was queued to or -1 on error. Unknown clients are skipped.
+ */
+int net_host_broadcast(struct host *, int flags, uint8_t *buffer, int buffer_len,
+                       const uint32_t *clients, int n);
+/* Like net_host_broadcast but sends to every connected client not in except */
+int net_host_broadcast_except(struct host *, int flags, uint8_t *buffer, int buffer_len,
+                              const uint32_t *except, int n);
+
+/*
+ * Received packets over their packet id's limit or the per client limit
+ * are dropped before they reach the game. A client that breaks the limits
+ * violations times within window_ms is disconnected with
+ * DISCONNECT_REASON_KICKED, and zero violations never disconnects. Limits must be set before the network thread is
+ * started and apply from the next connecting client.
+ */
+int net_host_set_packet_limit(struct host *, uint8_t id, uint32_t rate,
+                              uint32_t burst, uint32_t max_size);
+int net_host_set_peer_limit(struct host *, uint32_t rate, uint32_t burst);
+int net_host_set_violation_limit(struct host *, uint32_t violations, uint32_t window_ms);
+
+int net_host_init_send_queue(struct host *, uint32_t descs, uint32_t bytes);
+struct send_queue *net_host_get_send_queue(struct host *);
+/*
+ * Sends everything in the send queue and empties it. Invalid descriptors and
+ * unknown clients are skipped. Returns the number of packets queued to
+ * clients or -1 on error.
+ */
+int net_host_flush_sends(struct host *);
+
+/*
+ * Switches net_host_poll_events to queueing received packets and events.
+ * Polling stops early once either queue is full.
+ */
+int net_host_init_recv_queue(struct host *, uint32_t packets, uint32_t events);
+struct recv_queue *net_host_get_recv_queue(struct host *);
+/* Frees the queued packets and empties the receive queue */
+void net_host_release_receives(struct host *);
+
+/*
+ * With a network thread the stats are a snapshot taken after the last time
+ * ENet was serviced. net_host_get_all_stats fills at most n entries and
+ * returns the number of connected clients written.
+ */
+int net_host_get_peer_stats(struct host *, uint32_t client, struct peer_stats *out);
+int net_host_get_all_stats(struct host *, struct peer_stats *out, int n);
+
+/*
+ * Several hosts, each on its own port and usually its own network thread,
+ * can be put in a registry to read their stats together from any thread.
+ * Peer stats are the ones published after the host was last serviced.
+ * Hosts are registered before their network thread is started and leave
+ * the registry when destroyed, and the registry is destroyed last.
+ */
+struct net_registry;
+
+struct host_summary
+{
+	uint32_t id; /* given to net_host_register */
+	uint32_t port;
+	uint32_t clients;
+	uint32_t max_clients;
+	/* Over every packet id */
+	uint64_t packets_in;
+	uint64_t bytes_in;
+	uint64_t packets_out;
+	uint64_t bytes_out;
+	uint64_t drops;
+};
+
+struct net_registry *net_registry_create(void);
+void net_registry_destroy(struct net_registry *);
+int net_host_register(struct host *, struct net_registry *, uint32_t id);
+void net_host_unregister(struct host *);
+/* Both fill at most n entries and return the number written */
+int net_registry_get_hosts(struct net_registry *, struct host_summary *out, int n);
+/* hosts receives the id of each client's host and may be NULL */
+int net_registry_get_all_stats(struct net_registry *, struct peer_stats *out,
+                               uint32_t *hosts, int n);
+/*
+ * Stops the network thread of every registered host at once. Must be
+ * called from the thread that polls all of them, usually before destroying
+ * the hosts on shutdown.
+ */
+void net_registry_stop_threads(struct net_registry *);
+
+#define NET_PACKET_IDS 256
+#define NET_HISTOGRAM_BUCKETS 24
+
+/*
+ * Totals per packet id (the first byte of the packet) since the host was
+ * created. Packets sent to many clients count once per client. Drops are
+ * packets that could not be handed to ENet or the game.
+ */
+struct packet_counters
+{
+	uint64_t packets_in;
+	uint64_t bytes_in;
+	uint64_t packets_out;
+	uint64_t bytes_out;
+	uint64_t drops;
+	uint64_t callback_ns; /* spent in receive_callback */
+};
+
+/*
+ * Histogram bucket i counts durations of at least 2^(i-1) and less than 2^i
+ * microseconds, bucket 0 anything under a microsecond and the last bucket
+ * everything longer. poll_us is the duration of net_host_poll_events calls,
+ * including waiting for events without a network thread. service_us is the
+ * time spent handling events each time ENet had some, excluding the wait.
+ */
+struct net_counters
+{
+	struct packet_counters packets[NET_PACKET_IDS];
+	uint64_t poll_us[NET_HISTOGRAM_BUCKETS];
+	uint64_t service_us[NET_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * The counters are always on and are safe to read from any thread. The
+ * snapshot is not atomic as a whole.
+ */
+void net_host_get_counters(struct host *, struct net_counters *out);
+
+/*
+ * Services ENet on a separate thread. Received events are passed to the
+ * thread calling net_host_poll_events through a queue_size long lock-free
+ * queue and sends go back through another. Polling never blocks and the
+ * timeout is ignored. The network thread waits at most service_timeout_ms
+ * for network activity before picking up new sends. All other functions
+ * must be called from the same (game) thread while the network thread runs.
+ */
+int net_host_start_thread(struct host *, uint32_t service_timeout_ms, uint32_t queue_size);
+void net_host_stop_thread(struct host *);
+
+/*
+ * Data sent to clients as a paced series of reliable packets, such as the
+ * compressed map. Every packet is packet_id followed by up to chunk_size
+ * bytes. The data is copied once, already split into packets, and the
+ * packets sent to every client point into that copy. The source is freed
+ * once every reference taken with create or retain has been released and
+ * ENet is done with the last packet. Replacing the data means creating a
+ * new source; streams that are running keep sending the old one.
+ */
+struct net_stream_source;
+
+struct net_stream_source *net_stream_source_create(uint8_t packet_id,
+                                                   const uint8_t *data,
+                                                   uint32_t len,
+                                                   uint32_t chunk_size);
+/* Takes another reference, for handing the source to another thread */
+struct net_stream_source *net_stream_source_retain(struct net_stream_source *);
+void net_stream_source_release(struct net_stream_source *);
+
+/*
+ * Starts streaming the source to a client. Packets in the send queue are
+ * flushed first so they arrive before the stream. Chunks are handed to ENet
+ * as the client acknowledges earlier ones, and progress and completion are
+ * reported as NET_EVENT_STREAM_* events through the stream callback or the
+ * receive queue. A client can have one stream at a time; with a network
+ * thread starting a second stream fails silently. The stream is dropped
+ * when the client disconnects.
+ */
+int net_host_stream(struct host *, uint32_t client, struct net_stream_source *);
+
+/*
+ * Each stream keeps at most rate times the round trip time in flight, but
+ * no more than peer_window bytes. A rate of zero uses the bandwidth the
+ * client advertised, or just peer_window if it did not. All streams
+ * together keep at most host_window bytes in flight, although every stream
+ * may always have one chunk going. Must be set before the network thread is
+ * started. Defaults to 64 KiB per client and 256 KiB in total.
+ */
+int net_host_set_stream_limits(struct host *, uint32_t rate, uint32_t peer_window,
+                               uint32_t host_window);
@@ -50,18 +50,7 @@ player_destroy(struct player *p)
 static inline int
 clipbox(struct map *map, float x, float y, float z)
 {
-	int sz;
-
-	if (x < 0 || x >= MAP_X || y < 0 || y >= MAP_Y)
-		return 1;
-	else if (z < 0)
-		return 0;
-	sz = (int) z;
-	if (sz == 63)
-		sz = 62;
-	else if (sz >= 64)
-		return 1;
-	return map_is_solid(map, (int) x, (int) y, sz);
+	return map_clipbox(map, x, y, z);
 }
 
 // original C code
@@ -302,3 +291,112 @@ move_player(struct map* map, struct player *p, float delta, float time)
 
 	return (0); // no fall damage
 }
+
+/*
+ * Same hull as boxclipmove: 0.45 around the position horizontally, from
+ * 0.45 above it (z points down) to the feet 2.25 below it, or 1.35 when
+ * crouching.
+ */
+static int
+player_overlaps_cell(const struct player *p, const vec3i *c)
+{
+	float bottom = p->crouching ? 1.35f : 2.25f;
+
+	return c->x < p->m.pos.x + 0.45f && c->x + 1 > p->m.pos.x - 0.45f
+	       && c->y < p->m.pos.y + 0.45f && c->y + 1 > p->m.pos.y - 0.45f
+	       && c->z < p->m.pos.z + bottom && c->z + 1 > p->m.pos.z - 0.45f;
+}
+
+static int
+placement_neighbour_solid(struct map *map, int x, int y, int z)
+{
+	if (x < 0 || x >= MAP_X || y < 0 || y >= MAP_Y || z < 0 || z >= MAP_Z)
+		return 0;
+	return map_is_solid(map, x, y, z);
+}
+
+/*
+ * Looks at the cells accepted before this one, returns 2 if the cell is one
+ * of them, 1 if it is next to one and 0 otherwise
+ */
+static int
+placement_batch(const vec3i *c, const vec3i *cells, const uint8_t *mask, int placed)
+{
+	int i, d, adjacent = 0;
+
+	for (i = 0; i < placed; i++) {
+		if (mask[i] != 0)
+			continue;
+		d = abs(cells[i].x - c->x) + abs(cells[i].y - c->y) + abs(cells[i].z - c->z);
+		if (d == 0)
+			return 2;
+		if (d == 1)
+			adjacent = 1;
+	}
+	return adjacent;
+}
+
+static int
+placement_adjacent(struct map *map, const vec3i *c)
+{
+	return placement_neighbour_solid(map, c->x - 1, c->y, c->z)
+	       || placement_neighbour_solid(map, c->x + 1, c->y, c->z)
+	       || placement_neighbour_solid(map, c->x, c->y - 1, c->z)
+	       || placement_neighbour_solid(map, c->x, c->y + 1, c->z)
+	       || placement_neighbour_solid(map, c->x, c->y, c->z - 1)
+	       || placement_neighbour_solid(map, c->x, c->y, c->z + 1);
+}
+
+int
+validate_placements(struct map *map, struct player *const *players, int n,
+                    const struct player *placer, const vec3i *cells, int count,
+                    uint8_t *out_mask)
+{
+	const vec3i *c;
+	bool placer_listed = false;
+	int i, j, valid, batch;
+	uint8_t m;
+
+	if (!map || !placer || n < 0 || count < 0 || (n > 0 && !players)
+	    || (count > 0 && (!cells || !out_mask)))
+		return -1;
+
+	for (j = 0; j < n; j++) {
+		if (players[j] == placer)
+			placer_listed = true;
+	}
+
+	valid = 0;
+	for (i = 0; i < count; i++) {
+		c = &cells[i];
+		m = 0;
+
+		// The bottom two layers are water
+		if (c->x < 0 || c->x >= MAP_X || c->y < 0 || c->y >= MAP_Y
+		    || c->z < 0 || c->z >= MAP_Z - 2 || map_is_solid(map, c->x, c->y, c->z)
+		    || (batch = placement_batch(c, cells, out_mask, i)) == 2) {
+			out_mask[i] = PLACEMENT_INVALID;
+			continue;
+		}
+
+		if (fabsf(c->x + 0.5f - placer->m.eyePos.x) > PLACEMENT_REACH
+		    || fabsf(c->y + 0.5f - placer->m.eyePos.y) > PLACEMENT_REACH
+		    || fabsf(c->z + 0.5f - placer->m.eyePos.z) > PLACEMENT_REACH)
+			m |= PLACEMENT_OUT_OF_REACH;
+
+		if (!batch && !placement_adjacent(map, c))
+			m |= PLACEMENT_NOT_ADJACENT;
+
+		if (!placer_listed && player_overlaps_cell(placer, c))
+			m |= PLACEMENT_OCCUPIED;
+		for (j = 0; j < n && !(m & PLACEMENT_OCCUPIED); j++) {
+			if (players[j] && player_overlaps_cell(players[j], c))
+				m |= PLACEMENT_OCCUPIED;
+		}
+
+		out_mask[i] = m;
+		if (m == 0)
+			valid++;
+	}
+	return valid;
+}
@@ -53,3 +53,33 @@ void player_destroy(struct player *);
 void player_set_orientation(struct player *, vec3f orientation);
 int player_try_uncrouch(struct map *, struct player *);
 long move_player(struct map *, struct player *, float delta, float time);
+
+/* Blocks can be placed this far from the eye on every axis */
+#define PLACEMENT_REACH 6.0f
+
+/* Why a cell can't have a block placed in it, zero if it can */
+enum placement_error
+{
+	PLACEMENT_INVALID      = (1 << 0), /* outside the map, water or already solid */
+	PLACEMENT_NOT_ADJACENT = (1 << 1), /* no solid voxel next to it */
+	PLACEMENT_OCCUPIED     = (1 << 2), /* inside a player's hull */
+	PLACEMENT_OUT_OF_REACH = (1 << 3),
+};
+
+/*
+ * Checks blocks placed by placer, such as from BlockAction or BlockLine,
+ * against the map and the players (NULL entries are skipped, the placer
+ * counts even if it is not among them). Player hulls are the ones used for
+ * movement. Cells accepted earlier in the same call count as solid, so a
+ * line only has to touch the map at one end. out_mask receives the
+ * placement_error bits of every cell.
+ *
+ * Returns the number of cells that can be placed or -1 on error.
+ */
+int validate_placements(struct map *,
+                        struct player *const *players,
+                        int n,
+                        const struct player *placer,
+                        const vec3i *cells,
+                        int count,
+                        uint8_t *out_mask);
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2025 JStalnac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+struct worker_pool
+{
+	pthread_t *threads;
+	int threads_len;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	/* Current batch, protected by lock */
+	worker_task task;
+	void *ctx;
+	int count;
+	unsigned int generation;
+	int active;
+	bool stop;
+
+	/* Next task index to hand out */
+	atomic_int next;
+};
+
+static void
+worker_pool_drain(struct worker_pool *pool, worker_task task, void *ctx, int count)
+{
+	int i;
+
+	// Tasks are handed out one at a time so uneven tasks still balance
+	while ((i = atomic_fetch_add(&pool->next, 1)) < count)
+		task(ctx, i);
+}
+
+static void *
+worker_pool_main(void *arg)
+{
+	struct worker_pool *pool = arg;
+	unsigned int seen = 0;
+	worker_task task;
+	void *ctx;
+	int count;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->stop && pool->generation == seen)
+			pthread_cond_wait(&pool->work_cond, &pool->lock);
+		if (pool->stop) {
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		seen = pool->generation;
+		task = pool->task;
+		ctx = pool->ctx;
+		count = pool->count;
+		pthread_mutex_unlock(&pool->lock);
+
+		worker_pool_drain(pool, task, ctx, count);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->active == 0)
+			pthread_cond_signal(&pool->done_cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+struct worker_pool *
+worker_pool_create(int threads)
+{
+	struct worker_pool *pool;
+
+	if (threads < 0)
+		return NULL;
+
+	if (!(pool = malloc(sizeof(*pool))))
+		return NULL;
+	memset(pool, 0, sizeof(*pool));
+	atomic_init(&pool->next, 0);
+
+	if (threads > 0 && !(pool->threads = malloc(sizeof(*pool->threads) * threads))) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (pool->threads_len = 0; pool->threads_len < threads; pool->threads_len++) {
+		if (pthread_create(&pool->threads[pool->threads_len], NULL,
+		                   worker_pool_main, pool) != 0) {
+			worker_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+void
+worker_pool_destroy(struct worker_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->threads_len; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+void
+worker_pool_run(struct worker_pool *pool, worker_task task, void *ctx, int count)
+{
+	int i;
+
+	if (count <= 0)
+		return;
+
+	if (!pool || pool->threads_len == 0 || count == 1) {
+		for (i = 0; i < count; i++)
+			task(ctx, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->task = task;
+	pool->ctx = ctx;
+	pool->count = count;
+	pool->active = pool->threads_len;
+	atomic_store(&pool->next, 0);
+	pool->generation++;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	worker_pool_drain(pool, task, ctx, count);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->active > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2025 JStalnac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A small fixed size pool of worker threads for splitting batched queries
+ * (visibility, explosions etc.) into independent tasks.
+ */
+
+typedef void (*worker_task)(void *ctx, int index);
+
+struct worker_pool;
+
+struct worker_pool *worker_pool_create(int threads);
+void worker_pool_destroy(struct worker_pool *);
+
+/*
+ * Calls task(ctx, i) for every i in [0, count) and returns once all of them
+ * have finished. The calling thread takes part in the work. A NULL pool runs
+ * every task on the calling thread. Not safe to call concurrently on the same
+ * pool.
+ */
+void worker_pool_run(struct worker_pool *, worker_task task, void *ctx, int count);
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2025 JStalnac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+int
+spsc_ring_init(struct spsc_ring *r, size_t elem_size, size_t capacity)
+{
+	size_t cap = 1;
+
+	if (!r || elem_size == 0 || capacity == 0)
+		return -1;
+
+	while (cap < capacity)
+		cap <<= 1;
+
+	if (!(r->slots = malloc(elem_size * cap)))
+		return -1;
+	r->elem_size = elem_size;
+	r->mask = cap - 1;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	return 0;
+}
+
+void
+spsc_ring_deinit(struct spsc_ring *r)
+{
+	if (!r)
+		return;
+	free(r->slots);
+	r->slots = NULL;
+	r->elem_size = 0;
+	r->mask = 0;
+}
+
+bool
+spsc_ring_push(struct spsc_ring *r, const void *elem)
+{
+	size_t tail, head;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (tail - head > r->mask)
+		return false;
+
+	memcpy(r->slots + (tail & r->mask) * r->elem_size, elem, r->elem_size);
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+size_t
+spsc_ring_room(struct spsc_ring *r)
+{
+	size_t tail, head;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+	return r->mask + 1 - (tail - head);
+}
+
+bool
+spsc_ring_pop(struct spsc_ring *r, void *elem)
+{
+	size_t head, tail;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (head == tail)
+		return false;
+
+	memcpy(elem, r->slots + (head & r->mask) * r->elem_size, r->elem_size);
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return true;
+}
+
+bool
+spsc_ring_empty(struct spsc_ring *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_relaxed)
+	       == atomic_load_explicit(&r->tail, memory_order_acquire);
+}
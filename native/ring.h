@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2025 JStalnac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPSC_RING_CACHE_LINE 64
+
+/*
+ * Lock-free ring buffer of fixed size elements for exactly one producer
+ * thread and one consumer thread.
+ *
+ * head and tail are kept a cache line apart from each other and from the
+ * surrounding fields with padding rather than _Alignas, so rings can be
+ * embedded in structs allocated with plain malloc.
+ */
+struct spsc_ring
+{
+	uint8_t *slots;
+	size_t elem_size;
+	size_t mask;
+
+	char pad0[SPSC_RING_CACHE_LINE];
+	/* Written by the consumer */
+	atomic_size_t head;
+	char pad1[SPSC_RING_CACHE_LINE - sizeof(atomic_size_t)];
+	/* Written by the producer */
+	atomic_size_t tail;
+	char pad2[SPSC_RING_CACHE_LINE - sizeof(atomic_size_t)];
+};
+
+/* The capacity is rounded up to a power of two */
+int spsc_ring_init(struct spsc_ring *, size_t elem_size, size_t capacity);
+void spsc_ring_deinit(struct spsc_ring *);
+
+/* Producer side */
+bool spsc_ring_push(struct spsc_ring *, const void *elem);
+size_t spsc_ring_room(struct spsc_ring *);
+
+/* Consumer side */
+bool spsc_ring_pop(struct spsc_ring *, void *elem);
+bool spsc_ring_empty(struct spsc_ring *);
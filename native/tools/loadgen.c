@@ -0,0 +1,645 @@
+/*
+ * Copyright (C) 2025 JStalnac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Load generator for the net_host_* layer. Runs a host in this process and
+ * connects simulated Ace of Spades clients to it over loopback. The clients
+ * send a mix of input, orientation, block and chat packets and the server
+ * sends world updates back. Reports how fast the server polls and the
+ * latency in both directions.
+ *
+ *   xmake build loadgen && xmake run loadgen --clients 300 --seconds 20
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <enet6/enet.h>
+
+#include "../net.h"
+
+#define PROTOCOL_VERSION 3
+
+#define PACKET_POSITION_DATA 0
+#define PACKET_ORIENTATION_DATA 1
+#define PACKET_WORLD_UPDATE 2
+#define PACKET_INPUT_DATA 3
+#define PACKET_BLOCK_ACTION 13
+#define PACKET_CHAT_MESSAGE 17
+
+#define WORLD_UPDATE_SIZE 769
+#define MAX_SAMPLES (1 << 21)
+
+struct options
+{
+	int clients;
+	int threads;
+	int seconds;
+	int tick_rate;
+	int update_rate;
+	double block_rate; /* per client per second */
+	double chat_rate;
+	uint16_t port;
+	bool network_thread;
+};
+
+/* Latencies in microseconds, appended by a single thread */
+struct samples
+{
+	uint32_t *values;
+	size_t len;
+};
+
+struct client_thread
+{
+	pthread_t thread;
+	const struct options *opts;
+	int index;
+	int clients;
+	ENetHost *host;
+	ENetPeer **peers;
+	bool *connected;
+	uint64_t rng;
+	struct samples latency;
+};
+
+static atomic_bool measuring;
+static atomic_bool stop;
+static atomic_int clients_connected;
+
+/* Server state, only touched from the polling thread */
+static struct samples server_latency;
+static uint64_t server_receives;
+static uint64_t server_events;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void
+sleep_ns(uint64_t ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = (time_t)(ns / 1000000000u);
+	ts.tv_nsec = (long)(ns % 1000000000u);
+	nanosleep(&ts, NULL);
+}
+
+static uint64_t
+next_random(uint64_t *state)
+{
+	// xorshift64
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+/* Whether an event with the given rate per second happens this tick */
+static bool
+chance(uint64_t *rng, double per_second, int tick_rate)
+{
+	double p = per_second / tick_rate;
+
+	return (double)(next_random(rng) >> 11) / (double)(1ull << 53) < p;
+}
+
+static void
+write_timestamp(uint8_t *p, uint64_t t)
+{
+	memcpy(p, &t, sizeof(t));
+}
+
+static uint64_t
+read_timestamp(const uint8_t *p)
+{
+	uint64_t t;
+
+	memcpy(&t, p, sizeof(t));
+	return t;
+}
+
+static int
+samples_init(struct samples *s)
+{
+	s->len = 0;
+	s->values = malloc(sizeof(*s->values) * MAX_SAMPLES);
+	return s->values ? 0 : -1;
+}
+
+static void
+samples_add(struct samples *s, uint64_t sent)
+{
+	uint64_t us;
+
+	if (!atomic_load_explicit(&measuring, memory_order_relaxed)
+	    || s->len >= MAX_SAMPLES)
+		return;
+	us = (now_ns() - sent) / 1000;
+	s->values[s->len++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static int
+compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+print_percentiles(const char *name, struct samples *s)
+{
+	static const double percentiles[] = { 50, 90, 99, 99.9 };
+	size_t i, k;
+
+	printf("%-24s", name);
+	if (s->len == 0) {
+		printf(" no samples\n");
+		return;
+	}
+
+	qsort(s->values, s->len, sizeof(*s->values), compare_u32);
+	for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++) {
+		k = (size_t)(percentiles[i] / 100 * (double)(s->len - 1));
+		printf(" p%-4g %6u us", percentiles[i], s->values[k]);
+	}
+	printf("  max %6u us  (%zu samples)\n", s->values[s->len - 1], s->len);
+}
+
+static int
+send_to(ENetPeer *peer, const uint8_t *data, size_t len, bool reliable)
+{
+	ENetPacket *packet;
+
+	packet = enet_packet_create(data, len, reliable
+	                            ? ENET_PACKET_FLAG_RELIABLE
+	                            : ENET_PACKET_FLAG_UNSEQUENCED);
+	if (!packet)
+		return -1;
+	if (enet_peer_send(peer, 0, packet) != 0) {
+		enet_packet_destroy(packet);
+		return -1;
+	}
+	return 0;
+}
+
+/* One tick worth of traffic from a client, sizes as in protocol 0.75 */
+static void
+client_tick(struct client_thread *t, int i, uint64_t tick)
+{
+	const struct options *opts = t->opts;
+	ENetPeer *peer = t->peers[i];
+	uint8_t buf[96];
+	size_t len;
+
+	// Orientation every tick carries the send time in place of the floats
+	memset(buf, 0, 13);
+	buf[0] = PACKET_ORIENTATION_DATA;
+	write_timestamp(buf + 1, now_ns());
+	send_to(peer, buf, 13, false);
+
+	if ((tick + (uint64_t)i) % (uint64_t)opts->tick_rate == 0) {
+		memset(buf, 0, 13);
+		buf[0] = PACKET_POSITION_DATA;
+		send_to(peer, buf, 13, false);
+	}
+
+	if (chance(&t->rng, 4, opts->tick_rate)) {
+		buf[0] = PACKET_INPUT_DATA;
+		buf[1] = (uint8_t)i;
+		buf[2] = (uint8_t)next_random(&t->rng);
+		send_to(peer, buf, 3, true);
+	}
+
+	if (chance(&t->rng, opts->block_rate, opts->tick_rate)) {
+		memset(buf, 0, 15);
+		buf[0] = PACKET_BLOCK_ACTION;
+		buf[1] = (uint8_t)i;
+		buf[2] = (uint8_t)(next_random(&t->rng) % 4);
+		send_to(peer, buf, 15, true);
+	}
+
+	if (chance(&t->rng, opts->chat_rate, opts->tick_rate)) {
+		len = 3 + (size_t)(next_random(&t->rng) % 80);
+		memset(buf, 'a', len);
+		buf[0] = PACKET_CHAT_MESSAGE;
+		buf[1] = (uint8_t)i;
+		buf[2] = 0;
+		buf[len - 1] = '\0';
+		send_to(peer, buf, len, true);
+	}
+}
+
+static void
+client_handle_event(struct client_thread *t, ENetEvent *ev)
+{
+	int i = (int)(uintptr_t)ev->peer->data;
+
+	switch (ev->type) {
+	case ENET_EVENT_TYPE_CONNECT:
+		t->connected[i] = true;
+		atomic_fetch_add(&clients_connected, 1);
+		break;
+	case ENET_EVENT_TYPE_RECEIVE:
+		if (ev->packet->dataLength >= 9
+		    && ev->packet->data[0] == PACKET_WORLD_UPDATE)
+			samples_add(&t->latency, read_timestamp(ev->packet->data + 1));
+		enet_packet_destroy(ev->packet);
+		break;
+	case ENET_EVENT_TYPE_DISCONNECT:
+	case ENET_EVENT_TYPE_DISCONNECT_TIMEOUT:
+		if (t->connected[i])
+			atomic_fetch_sub(&clients_connected, 1);
+		t->connected[i] = false;
+		break;
+	default:
+		break;
+	}
+}
+
+static void *
+client_main(void *arg)
+{
+	struct client_thread *t = arg;
+	const struct options *opts = t->opts;
+	uint64_t tick_ns, next_tick, tick, now;
+	ENetEvent ev;
+	int i;
+
+	tick_ns = 1000000000u / (uint64_t)opts->tick_rate;
+	next_tick = now_ns();
+	tick = 0;
+
+	while (!atomic_load(&stop)) {
+		while (enet_host_service(t->host, &ev, 0) > 0)
+			client_handle_event(t, &ev);
+
+		now = now_ns();
+		if (now >= next_tick) {
+			for (i = 0; i < t->clients; i++) {
+				if (t->connected[i])
+					client_tick(t, i, tick);
+			}
+			enet_host_flush(t->host);
+			tick++;
+			next_tick += tick_ns;
+			// Don't try to catch up after falling behind
+			if (next_tick < now)
+				next_tick = now + tick_ns;
+		}
+
+		now = now_ns();
+		if (next_tick > now)
+			sleep_ns(next_tick - now < 1000000 ? next_tick - now : 1000000);
+	}
+
+	for (i = 0; i < t->clients; i++)
+		enet_peer_disconnect_now(t->peers[i], 0);
+	enet_host_flush(t->host);
+	return NULL;
+}
+
+static int
+client_thread_init(struct client_thread *t, const struct options *opts,
+                   int index, int clients)
+{
+	ENetAddress address;
+	int i;
+
+	memset(t, 0, sizeof(*t));
+	t->opts = opts;
+	t->index = index;
+	t->clients = clients;
+	t->rng = 0x9e3779b97f4a7c15ull * (uint64_t)(index + 1);
+
+	if (samples_init(&t->latency) != 0)
+		return -1;
+	if (!(t->peers = calloc((size_t)clients, sizeof(*t->peers))))
+		return -1;
+	if (!(t->connected = calloc((size_t)clients, sizeof(*t->connected))))
+		return -1;
+
+	// Every peer of the host is a separate client to the server
+	t->host = enet_host_create(ENET_ADDRESS_TYPE_IPV4, NULL, (size_t)clients,
+	                           1, 0, 0);
+	if (!t->host)
+		return -1;
+	enet_host_compress_with_range_coder(t->host);
+
+	if (enet_address_set_host_ip(&address, "127.0.0.1") != 0)
+		return -1;
+	address.port = opts->port;
+
+	for (i = 0; i < clients; i++) {
+		if (!(t->peers[i] = enet_host_connect(t->host, &address, 1,
+		                                      PROTOCOL_VERSION)))
+			return -1;
+		t->peers[i]->data = (void *)(uintptr_t)i;
+	}
+	return 0;
+}
+
+static void
+client_thread_deinit(struct client_thread *t)
+{
+	if (t->host)
+		enet_host_destroy(t->host);
+	free(t->peers);
+	free(t->connected);
+	free(t->latency.values);
+}
+
+static enum callback_result
+on_connect(uint32_t client, uint32_t data)
+{
+	(void)client;
+	(void)data;
+	server_events++;
+	return CALLBACK_RESULT_CONTINUE;
+}
+
+static enum callback_result
+on_receive(uint32_t client, uint8_t *buffer, int32_t len)
+{
+	(void)client;
+	server_events++;
+	server_receives++;
+	if (len >= 9 && buffer[0] == PACKET_ORIENTATION_DATA)
+		samples_add(&server_latency, read_timestamp(buffer + 1));
+	return CALLBACK_RESULT_CONTINUE;
+}
+
+static enum callback_result
+on_disconnect(uint32_t client, uint32_t type)
+{
+	(void)client;
+	(void)type;
+	server_events++;
+	return CALLBACK_RESULT_CONTINUE;
+}
+
+static void
+print_counters(const struct net_counters *before, const struct net_counters *after,
+               double seconds)
+{
+	const struct packet_counters *a, *b;
+	int i;
+
+	printf("\n%-4s %12s %12s %12s %12s %8s %10s\n", "id", "in/s", "in B/s",
+	       "out/s", "out B/s", "drops", "cb ns/pkt");
+	for (i = 0; i < NET_PACKET_IDS; i++) {
+		a = &after->packets[i];
+		b = &before->packets[i];
+		if (a->packets_in == b->packets_in && a->packets_out == b->packets_out
+		    && a->drops == b->drops)
+			continue;
+		printf("%-4d %12.0f %12.0f %12.0f %12.0f %8llu %10.0f\n", i,
+		       (double)(a->packets_in - b->packets_in) / seconds,
+		       (double)(a->bytes_in - b->bytes_in) / seconds,
+		       (double)(a->packets_out - b->packets_out) / seconds,
+		       (double)(a->bytes_out - b->bytes_out) / seconds,
+		       (unsigned long long)(a->drops - b->drops),
+		       a->packets_in == b->packets_in ? 0.0
+		       : (double)(a->callback_ns - b->callback_ns)
+		         / (double)(a->packets_in - b->packets_in));
+	}
+}
+
+static void
+usage(const char *name)
+{
+	fprintf(stderr,
+	        "usage: %s [--clients N] [--threads N] [--seconds N] [--tick-rate HZ]\n"
+	        "          [--update-rate HZ] [--block-rate R] [--chat-rate R]\n"
+	        "          [--port PORT] [--network-thread]\n", name);
+}
+
+static int
+parse_options(int argc, char **argv, struct options *opts)
+{
+	int i;
+
+	opts->clients = 200;
+	opts->threads = 4;
+	opts->seconds = 10;
+	opts->tick_rate = 60;
+	opts->update_rate = 10;
+	opts->block_rate = 0.5;
+	opts->chat_rate = 0.05;
+	opts->port = 32888;
+	opts->network_thread = false;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--network-thread") == 0) {
+			opts->network_thread = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+			return -1;
+		if (strcmp(argv[i], "--clients") == 0)
+			opts->clients = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0)
+			opts->threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seconds") == 0)
+			opts->seconds = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--tick-rate") == 0)
+			opts->tick_rate = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--update-rate") == 0)
+			opts->update_rate = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--block-rate") == 0)
+			opts->block_rate = atof(argv[++i]);
+		else if (strcmp(argv[i], "--chat-rate") == 0)
+			opts->chat_rate = atof(argv[++i]);
+		else if (strcmp(argv[i], "--port") == 0)
+			opts->port = (uint16_t)atoi(argv[++i]);
+		else
+			return -1;
+	}
+
+	if (opts->clients <= 0 || opts->threads <= 0 || opts->seconds <= 0
+	    || opts->tick_rate <= 0 || opts->update_rate <= 0)
+		return -1;
+	if (opts->threads > opts->clients)
+		opts->threads = opts->clients;
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	static struct net_counters before, after;
+	static uint8_t world_update[WORLD_UPDATE_SIZE];
+	struct options opts;
+	struct client_thread *threads;
+	struct samples poll_times, client_latency;
+	struct host *host;
+	uint64_t start, end, now, poll_start, update_ns, next_update;
+	uint64_t events, receives;
+	double seconds;
+	size_t n;
+	int i, per_thread, ret;
+
+	if (parse_options(argc, argv, &opts) != 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (enet_initialize() != 0) {
+		fprintf(stderr, "Failed to initialise ENet\n");
+		return 1;
+	}
+
+	host = net_host_create_listener(ADDRESS_TYPE_IPV4, opts.port,
+	                                (size_t)opts.clients, 1, 0, 0);
+	if (!host) {
+		fprintf(stderr, "Failed to create host on port %u\n", opts.port);
+		return 1;
+	}
+	net_host_set_connect_callback(host, on_connect);
+	net_host_set_receive_callback(host, on_receive);
+	net_host_set_disconnect_callback(host, on_disconnect);
+	if (opts.network_thread && net_host_start_thread(host, 1, 16384) != 0) {
+		fprintf(stderr, "Failed to start the network thread\n");
+		return 1;
+	}
+
+	if (samples_init(&server_latency) != 0 || samples_init(&poll_times) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	if (!(threads = calloc((size_t)opts.threads, sizeof(*threads)))) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	per_thread = (opts.clients + opts.threads - 1) / opts.threads;
+	for (i = 0; i < opts.threads; i++) {
+		n = (size_t)(opts.clients - i * per_thread);
+		if (n > (size_t)per_thread)
+			n = (size_t)per_thread;
+		if (client_thread_init(&threads[i], &opts, i, (int)n) != 0
+		    || pthread_create(&threads[i].thread, NULL, client_main,
+		                      &threads[i]) != 0) {
+			fprintf(stderr, "Failed to start client thread %d\n", i);
+			return 1;
+		}
+	}
+
+	update_ns = 1000000000u / (uint64_t)opts.update_rate;
+	world_update[0] = PACKET_WORLD_UPDATE;
+
+	// Connect everyone first, then measure
+	start = now_ns();
+	next_update = start;
+	end = start + 10 * 1000000000ull;
+	while (atomic_load(&clients_connected) < opts.clients && now_ns() < end) {
+		if (net_host_poll_events(host, 1) < 0)
+			fprintf(stderr, "Polling failed\n");
+		if (opts.network_thread)
+			sleep_ns(1000000);
+	}
+	printf("%d/%d clients connected in %.2f s\n", atomic_load(&clients_connected),
+	       opts.clients, (double)(now_ns() - start) / 1e9);
+
+	net_host_get_counters(host, &before);
+	events = server_events;
+	receives = server_receives;
+	atomic_store(&measuring, true);
+	start = now_ns();
+	end = start + (uint64_t)opts.seconds * 1000000000u;
+
+	while ((now = now_ns()) < end) {
+		if (now >= next_update) {
+			write_timestamp(world_update + 1, now);
+			net_host_broadcast_except(host, PACKET_FLAG_UNSEQUENCED,
+			                          world_update, WORLD_UPDATE_SIZE, NULL, 0);
+			next_update += update_ns;
+			if (next_update < now)
+				next_update = now + update_ns;
+		}
+
+		poll_start = now_ns();
+		ret = net_host_poll_events(host, 1);
+		if (ret < 0)
+			fprintf(stderr, "Polling failed\n");
+		samples_add(&poll_times, poll_start);
+
+		// Polling does not block with a network thread
+		if (opts.network_thread)
+			sleep_ns(200000);
+	}
+
+	atomic_store(&measuring, false);
+	seconds = (double)(now_ns() - start) / 1e9;
+	net_host_get_counters(host, &after);
+
+	atomic_store(&stop, true);
+	for (i = 0; i < opts.threads; i++)
+		pthread_join(threads[i].thread, NULL);
+
+	// Everything the clients measured goes into one set
+	n = 0;
+	for (i = 0; i < opts.threads; i++)
+		n += threads[i].latency.len;
+	client_latency.len = 0;
+	client_latency.values = malloc(sizeof(*client_latency.values) * (n ? n : 1));
+	for (i = 0; i < opts.threads && client_latency.values; i++) {
+		memcpy(client_latency.values + client_latency.len,
+		       threads[i].latency.values,
+		       sizeof(*client_latency.values) * threads[i].latency.len);
+		client_latency.len += threads[i].latency.len;
+	}
+
+	printf("\n%d clients, %d Hz ticks, %d Hz world updates, %s, %.1f s\n",
+	       opts.clients, opts.tick_rate, opts.update_rate,
+	       opts.network_thread ? "network thread" : "polling thread",
+	       seconds);
+	printf("server handled %.0f events/s (%.0f packets/s)\n",
+	       (double)(server_events - events) / seconds,
+	       (double)(server_receives - receives) / seconds);
+	print_percentiles("poll duration", &poll_times);
+	print_percentiles("client -> server", &server_latency);
+	if (client_latency.values)
+		print_percentiles("server -> client", &client_latency);
+	print_counters(&before, &after, seconds);
+
+	for (i = 0; i < opts.threads; i++)
+		client_thread_deinit(&threads[i]);
+	free(threads);
+	free(client_latency.values);
+	free(poll_times.values);
+	free(server_latency.values);
+	net_host_destroy(host);
+	enet_deinitialize();
+	return 0;
+}
@@ -49,4 +49,11 @@ typedef struct
     long z;
 } vec3l;
 
+/* Axis aligned box in map coordinates, max is inclusive */
+typedef struct
+{
+    vec3f min;
+    vec3f max;
+} box;
+
 #endif
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2025 JStalnac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "hit_detection.h"
+
+#include "world_update.h"
+
+struct world_update_builder
+{
+	uint32_t tick;
+
+	/* Entry last sent to each recipient for each player */
+	uint8_t last[WORLD_UPDATE_MAX_PLAYERS][WORLD_UPDATE_MAX_PLAYERS][WORLD_UPDATE_ENTRY_SIZE];
+	bool has_last[WORLD_UPDATE_MAX_PLAYERS][WORLD_UPDATE_MAX_PLAYERS];
+
+	uint8_t buffers[WORLD_UPDATE_MAX_PLAYERS][WORLD_UPDATE_SIZE];
+	uint32_t hashes[WORLD_UPDATE_MAX_PLAYERS];
+
+	/* Active players packed together for can_see_matrix */
+	int ids[WORLD_UPDATE_MAX_PLAYERS];
+	vec3f positions[WORLD_UPDATE_MAX_PLAYERS];
+	uint8_t visible[WORLD_UPDATE_MAX_PLAYERS * ((WORLD_UPDATE_MAX_PLAYERS + 7) / 8)];
+};
+
+struct world_update_builder *
+world_update_builder_create()
+{
+	struct world_update_builder *b;
+
+	if (!(b = malloc(sizeof(*b))))
+		return NULL;
+	memset(b, 0, sizeof(*b));
+	return b;
+}
+
+void
+world_update_builder_destroy(struct world_update_builder *b)
+{
+	if (!b)
+		return;
+	free(b);
+}
+
+static inline uint8_t *
+write_float(uint8_t *p, float f)
+{
+	uint32_t v;
+
+	memcpy(&v, &f, sizeof(v));
+	p[0] = (uint8_t) (v >>  0);
+	p[1] = (uint8_t) (v >>  8);
+	p[2] = (uint8_t) (v >> 16);
+	p[3] = (uint8_t) (v >> 24);
+	return p + 4;
+}
+
+static inline void
+write_entry(uint8_t *p, const vec3f *pos, const vec3f *orientation)
+{
+	p = write_float(p, pos->x);
+	p = write_float(p, pos->y);
+	p = write_float(p, pos->z);
+	p = write_float(p, orientation->x);
+	p = write_float(p, orientation->y);
+	write_float(p, orientation->z);
+}
+
+static uint32_t
+hash_buffer(const uint8_t *p, size_t len)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+int
+world_update_build(struct world_update_builder *b, struct worker_pool *pool,
+                   struct map *map, const struct world_update_players *players,
+                   const struct world_update_policy *policy,
+                   const uint8_t **buffers, int *index)
+{
+	float near_sq, far_sq, dx, dy, dz, d;
+	size_t stride;
+	uint8_t *buf, *entry;
+	int m, r, a, p, k, count;
+	bool fresh;
+
+	if (!b || !players || !policy || !buffers || !index)
+		return -1;
+	if (players->n < 0 || players->n > WORLD_UPDATE_MAX_PLAYERS)
+		return -1;
+	if (players->n > 0 && (!players->positions || !players->orientations
+	                       || !players->active))
+		return -1;
+	if (policy->hide_occluded && !map)
+		return -1;
+
+	near_sq = policy->near_distance * policy->near_distance;
+	far_sq = policy->far_distance * policy->far_distance;
+
+	m = 0;
+	for (p = 0; p < players->n; p++) {
+		if (!players->active[p]) {
+			// Start from scratch if the slot is taken again
+			memset(b->has_last[p], 0, sizeof(b->has_last[p]));
+			for (r = 0; r < WORLD_UPDATE_MAX_PLAYERS; r++)
+				b->has_last[r][p] = false;
+			continue;
+		}
+		b->ids[m] = p;
+		b->positions[m] = players->positions[p];
+		m++;
+	}
+
+	stride = ((size_t)m + 7) / 8;
+	if (policy->hide_occluded && m > 0) {
+		if (can_see_matrix(pool, map, b->positions, m,
+		                   policy->far_distance, b->visible) != 0)
+			return -1;
+	}
+
+	for (p = 0; p < players->n; p++)
+		index[p] = -1;
+
+	count = 0;
+	for (r = 0; r < m; r++) {
+		buf = b->buffers[count];
+		memset(buf, 0, WORLD_UPDATE_SIZE);
+		buf[0] = WORLD_UPDATE_PACKET_ID;
+
+		for (a = 0; a < m; a++) {
+			p = b->ids[a];
+			entry = buf + 1 + p * WORLD_UPDATE_ENTRY_SIZE;
+
+			dx = b->positions[a].x - b->positions[r].x;
+			dy = b->positions[a].y - b->positions[r].y;
+			dz = b->positions[a].z - b->positions[r].z;
+			d = dx * dx + dy * dy + dz * dz;
+
+			if (a == r || d <= near_sq) {
+				fresh = true;
+			} else if ((far_sq > 0 && d > far_sq)
+			           || (policy->hide_occluded
+			               && !(b->visible[stride * r + (a >> 3)] & (1 << (a & 7))))) {
+				// Out of interest, leave the entry zeroed
+				b->has_last[b->ids[r]][p] = false;
+				continue;
+			} else {
+				fresh = policy->far_interval <= 1
+				        || !b->has_last[b->ids[r]][p]
+				        || (b->tick + p) % policy->far_interval == 0;
+			}
+
+			if (fresh) {
+				write_entry(entry, &players->positions[p],
+				            &players->orientations[p]);
+				memcpy(b->last[b->ids[r]][p], entry, WORLD_UPDATE_ENTRY_SIZE);
+				b->has_last[b->ids[r]][p] = true;
+			} else {
+				memcpy(entry, b->last[b->ids[r]][p], WORLD_UPDATE_ENTRY_SIZE);
+			}
+		}
+
+		b->hashes[count] = hash_buffer(buf, WORLD_UPDATE_SIZE);
+		for (k = 0; k < count; k++) {
+			if (b->hashes[k] == b->hashes[count]
+			    && memcmp(b->buffers[k], buf, WORLD_UPDATE_SIZE) == 0)
+				break;
+		}
+		index[b->ids[r]] = k;
+		if (k == count) {
+			buffers[count] = buf;
+			count++;
+		}
+	}
+
+	b->tick++;
+	return count;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2025 JStalnac
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "types.h"
+
+#define WORLD_UPDATE_PACKET_ID 2
+#define WORLD_UPDATE_MAX_PLAYERS 32
+/* Position and orientation, both three little endian floats */
+#define WORLD_UPDATE_ENTRY_SIZE 24
+#define WORLD_UPDATE_SIZE (1 + WORLD_UPDATE_MAX_PLAYERS * WORLD_UPDATE_ENTRY_SIZE)
+
+struct map;
+struct worker_pool;
+
+/*
+ * Player state as separate arrays indexed by player id. Players with active
+ * set to zero are sent as zeroes and receive no update themselves.
+ */
+struct world_update_players
+{
+	const vec3f *positions;
+	const vec3f *orientations;
+	const uint8_t *active;
+	int n;
+};
+
+struct world_update_policy
+{
+	/* Players closer than this are always sent to the recipient */
+	float near_distance;
+	/* Players further than this are sent as zeroes, zero for no limit */
+	float far_distance;
+	/*
+	 * Players between near_distance and far_distance are refreshed every
+	 * far_interval ticks. The last sent values are repeated otherwise.
+	 */
+	int far_interval;
+	/* Zero players the recipient cannot see (according to can_see) */
+	int hide_occluded;
+};
+
+struct world_update_builder;
+
+struct world_update_builder *world_update_builder_create();
+void world_update_builder_destroy(struct world_update_builder *);
+
+/*
+ * Builds one WorldUpdate packet (including the packet id) for every active
+ * recipient. Recipients with identical packets share a buffer: recipient i
+ * should be sent buffers[index[i]], which is WORLD_UPDATE_SIZE bytes long.
+ * Inactive recipients get an index of -1. Both arrays must hold n elements.
+ * The buffers stay valid until the next call or until the builder is
+ * destroyed.
+ *
+ * Returns the number of distinct buffers or -1 on error.
+ */
+int world_update_build(struct world_update_builder *,
+                       struct worker_pool *,
+                       struct map *,
+                       const struct world_update_players *,
+                       const struct world_update_policy *,
+                       const uint8_t **buffers,
+                       int *index);
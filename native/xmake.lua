@@ -5,9 +5,21 @@ set_languages("c11")
 set_warnings("allextra", "pedantic")
 
 add_requires("enet6 6.1.2")
+add_requires("zlib")
 
 target("sharpspades", function ()
     set_kind("shared")
     add_files("*.c")
+    add_packages("enet6", "zlib")
+    add_syslinks("pthread", "m")
+end)
+
+-- Simulated clients hammering a local host, see tools/loadgen.c
+target("loadgen", function ()
+    set_kind("binary")
+    set_default(false)
+    add_files("tools/loadgen.c")
+    add_deps("sharpspades")
     add_packages("enet6")
+    add_syslinks("pthread")
 end)